@@ -104,12 +104,34 @@ static ALWAYS_INLINE void arch_tlbi_vmalle1is() {
     arch_fence();
 }
 
+// flush TLB entries of this cpu only.
+static ALWAYS_INLINE void arch_tlbi_vmalle1() {
+    arch_fence();
+    asm volatile("tlbi vmalle1");
+    arch_fence();
+}
+
+// flush TLB entries tagged with `asid`, on all cpus.
+static ALWAYS_INLINE void arch_tlbi_aside1is(u64 asid) {
+    arch_fence();
+    asm volatile("tlbi aside1is, %[x]" : : [x] "r"(asid << 48));
+    arch_fence();
+}
+
 // set Translation Table Base Register 0 (EL1).
 static ALWAYS_INLINE void arch_set_ttbr0(u64 addr) {
     arch_fence();
     asm volatile("msr ttbr0_el1, %[x]" : : [x] "r"(addr));
     arch_tlbi_vmalle1is();
 }
+
+// set TTBR0 (EL1) with an ASID, keeping the TLB: entries of other ASIDs
+// do not match.
+static ALWAYS_INLINE void arch_set_ttbr0_asid(u64 addr, u64 asid) {
+    arch_fence();
+    asm volatile("msr ttbr0_el1, %[x]" : : [x] "r"(addr | (asid << 48)));
+    arch_isb();
+}
 // get
 static inline WARN_RESULT u64 arch_get_ttbr0() {
     u64 result;
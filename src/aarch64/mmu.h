@@ -32,9 +32,12 @@
 #define PTE_RO (1 << 7)
 #define PTE_RW (0 << 7)
 
+// not global: the TLB entry is tagged with the ASID
+#define PTE_NG (1 << 11)
+
 #define PTE_KERNEL_DATA   (PTE_KERNEL | PTE_NORMAL | PTE_BLOCK)
 #define PTE_KERNEL_DEVICE (PTE_KERNEL | PTE_DEVICE | PTE_BLOCK)
-#define PTE_USER_DATA     (PTE_USER | PTE_NORMAL | PTE_PAGE)
+#define PTE_USER_DATA     (PTE_USER | PTE_NORMAL | PTE_PAGE | PTE_NG)
 
 #define N_PTE_PER_TABLE 512
 
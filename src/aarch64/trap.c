@@ -11,7 +11,7 @@
 
 void trap_global_handler(UserContext* context)
 {
-    u64 traptime = get_timestamp_ms();
+    u64 traptime = get_timestamp();
     struct proc* this = thisproc();
     this->ucontext = context;
     int exp_lvl = EXP_LVL(context->spsr);
@@ -61,7 +61,7 @@ void trap_global_handler(UserContext* context)
 
     // Stop killed process while returning to user space
     if (exp_lvl == 0) {
-        this->schinfo.traptime = -1;
+        this->schinfo.traptime = 0;
         if (this->killed)
             exit(-1);
     }
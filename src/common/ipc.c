@@ -88,7 +88,7 @@ static void free_msg(msg_msg* msg) {
     kfree_page(msg);
 }
 static msg_msg* load_msg(void* src, int len) {
-    msg_msg* msg = (msg_msg*)kalloc_page();
+    msg_msg* msg = (msg_msg*)kalloc_page_nozero_tagged(PAGE_TAG_IPC);
     if (msg == NULL)
         return NULL;
     memcpy(msg->data, src, MIN(MSG_MSGSZ, len));
@@ -97,7 +97,7 @@ static msg_msg* load_msg(void* src, int len) {
     msg->nxt = NULL;
     msg_msgseg** lst = &msg->nxt;
     while (len > 0) {
-        msg_msgseg* mseg = (msg_msgseg*)kalloc_page();
+        msg_msgseg* mseg = (msg_msgseg*)kalloc_page_nozero_tagged(PAGE_TAG_IPC);
         if (mseg == NULL)
             goto free_obj;
         memcpy(mseg->data, src, MIN(MSG_MSGSEGSZ, len));
@@ -246,6 +246,7 @@ static void __rb_erase_fix(rb_node parent, rb_root root) {
 }
 int _rb_insert(rb_node node, rb_root rt, bool (*cmp)(rb_node lnode, rb_node rnode)) {
     rb_node nw = rt->rb_node, parent = NULL;
+    bool leftmost = true;
     node->rb_left = node->rb_right = NULL;
     node->__rb_parent_color = 0;
     while (nw) {
@@ -258,6 +259,7 @@ int _rb_insert(rb_node node, rb_root rt, bool (*cmp)(rb_node lnode, rb_node rnod
             }
         } else if (cmp(nw, node)) {
             nw = nw->rb_right;
+            leftmost = false;
             if (nw == NULL) {
                 parent->rb_right = node;
                 node->__rb_parent_color = (unsigned long)parent;
@@ -265,11 +267,15 @@ int _rb_insert(rb_node node, rb_root rt, bool (*cmp)(rb_node lnode, rb_node rnod
         } else
             return -1;
     }
+    if (leftmost)
+        rt->rb_leftmost = node;
     __rb_insert_fix(node, rt);
     return 0;
 }
 void _rb_erase(rb_node node, rb_root root) {
     rb_node rebalance;
+    if (root->rb_leftmost == node)
+        root->rb_leftmost = _rb_next(node);
     rebalance = __rb_erase(node, root);
     if (rebalance)
         __rb_erase_fix(rebalance, root);
@@ -287,11 +293,17 @@ rb_node _rb_lookup(rb_node node, rb_root rt, bool (*cmp)(rb_node lnode, rb_node
     return NULL;
 }
 rb_node _rb_first(rb_root root) {
-    rb_node n;
-    n = root->rb_node;
-    if (!n)
-        return NULL;
-    while (n->rb_left)
-        n = n->rb_left;
-    return n;
+    return root->rb_leftmost;
+}
+rb_node _rb_next(rb_node node) {
+    rb_node parent;
+    if (node->rb_right) {
+        node = node->rb_right;
+        while (node->rb_left)
+            node = node->rb_left;
+        return node;
+    }
+    while ((parent = rb_parent(node)) && node == parent->rb_right)
+        node = parent;
+    return parent;
 }
\ No newline at end of file
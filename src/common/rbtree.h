@@ -9,6 +9,7 @@ struct rb_node_ {
 typedef struct rb_node_ *rb_node;
 struct rb_root_ {
     rb_node rb_node;
+    rb_node rb_leftmost; /* cached by insert and erase, so _rb_first is O(1) */
 };
 typedef struct rb_root_ *rb_root;
 /* NOTE:You should add lock when use */
@@ -16,4 +17,5 @@ WARN_RESULT int _rb_insert(rb_node node,rb_root root,bool (*cmp)(rb_node lnode,r
 void _rb_erase(rb_node node, rb_root root);
 rb_node _rb_lookup(rb_node node,rb_root rt,bool (*cmp)(rb_node lnode,rb_node rnode));
 rb_node _rb_first(rb_root root);
+rb_node _rb_next(rb_node node);
 #endif
\ No newline at end of file
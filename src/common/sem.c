@@ -2,6 +2,22 @@
 #include <kernel/mem.h>
 #include <kernel/sched.h>
 #include <kernel/printk.h>
+#include <kernel/init.h>
+
+static struct kmem_cache* waitdata_cache;
+
+static void waitdata_ctor(void* p)
+{
+    WaitData* wait = p;
+    wait->up = false;
+    wait->proc = NULL;
+    init_list_node(&wait->slnode);
+}
+
+define_early_init(waitdata_cache)
+{
+    waitdata_cache = kmem_cache_create("WaitData", sizeof(WaitData), waitdata_ctor);
+}
 
 void init_sem(Semaphore* sem, int val)
 {
@@ -69,9 +85,9 @@ bool _wait_sem(Semaphore* sem, bool alertable)
         release_spinlock(0, &sem->lock);
         return true;
     }
-    WaitData* wait = kalloc(sizeof(WaitData));
+    // Objects come back constructed: slnode detached and up == false
+    WaitData* wait = kmem_cache_alloc(waitdata_cache);
     wait->proc = thisproc();
-    wait->up = false;
     _insert_into_list(&sem->sleeplist, &wait->slnode);
     lock_for_sched(0);
     release_spinlock(0, &sem->lock);
@@ -84,7 +100,8 @@ bool _wait_sem(Semaphore* sem, bool alertable)
     }
     release_spinlock(0, &sem->lock);
     bool ret = wait->up;
-    kfree(wait);
+    wait->up = false;
+    kmem_cache_free(waitdata_cache, wait);
     return ret;
 }
 
@@ -7,6 +7,7 @@ typedef void (*ClockHandler)(void);
 WARN_RESULT u64 get_timestamp_ms();
 void init_clock();
 void reset_clock(u64 countdown_ms);
+void stop_clock();
 void set_clock_handler(ClockHandler handler);
 void invoke_clock_handler();
 
@@ -6,8 +6,10 @@
 #include <kernel/init.h>
 #include <kernel/printk.h>
 #include <kernel/sched.h>
+#include <kernel/cpu.h>
 
 static InterruptHandler int_handler[NUM_IRQ_TYPES];
+static InterruptHandler ipi_handler;
 
 define_early_init(interrupt)
 {
@@ -26,9 +28,26 @@ void set_interrupt_handler(InterruptType type, InterruptHandler handler)
     int_handler[type] = handler;
 }
 
+void init_ipi()
+{
+    device_put_u32(MBOX0_CLR(cpuid()), ~0u);
+    device_put_u32(MBOX_INT_CTRL(cpuid()), MBOX0_IRQ_ENABLE);
+}
+
+void send_ipi(int cpu)
+{
+    device_put_u32(MBOX0_SET(cpu), 1);
+}
+
+void set_ipi_handler(InterruptHandler handler)
+{
+    ipi_handler = handler;
+}
+
 void interrupt_global_handler()
 {
     u32 source = device_get_u32(IRQ_SRC_CORE(cpuid()));
+    cpus[cpuid()].nr_irqs++;
 
     if (source & IRQ_SRC_CNTPNSIRQ)
     {
@@ -36,6 +55,14 @@ void interrupt_global_handler()
         invoke_clock_handler();
     }
 
+    if (source & IRQ_SRC_MBOX0)
+    {
+        source ^= IRQ_SRC_MBOX0;
+        device_put_u32(MBOX0_CLR(cpuid()), ~0u);
+        if (ipi_handler)
+            ipi_handler();
+    }
+
     if (source & IRQ_SRC_GPU)
     {
         source ^= IRQ_SRC_GPU;
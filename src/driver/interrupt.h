@@ -14,3 +14,10 @@ typedef void (*InterruptHandler)();
 
 void interrupt_global_handler();
 void set_interrupt_handler(InterruptType type, InterruptHandler handler);
+
+// Inter-processor interrupts through mailbox 0 of the local peripherals.
+// init_ipi() enables them on the calling cpu; send_ipi() interrupts `cpu`,
+// which then runs the handler set by set_ipi_handler().
+void init_ipi();
+void send_ipi(int cpu);
+void set_ipi_handler(InterruptHandler handler);
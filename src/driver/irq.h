@@ -22,8 +22,15 @@
 #define IRQ_SRC_TIMER       (1 << 11) /* Local Timer */
 #define IRQ_SRC_GPU         (1 << 8)
 #define IRQ_SRC_CNTPNSIRQ   (1 << 1) /* Core Timer */
+#define IRQ_SRC_MBOX0       (1 << 4) /* Mailbox 0 */
 #define FIQ_SRC_CORE(i)   (LOCAL_BASE + 0x70 + 4 * (i))
 
+/* Local mailboxes, used for inter-processor interrupts */
+#define MBOX_INT_CTRL(i)  (LOCAL_BASE + 0x50 + 4 * (i))
+#define MBOX0_IRQ_ENABLE  (1 << 0)
+#define MBOX0_SET(i)      (LOCAL_BASE + 0x80 + 0x10 * (i)) /* write-set */
+#define MBOX0_CLR(i)      (LOCAL_BASE + 0xC0 + 0x10 * (i)) /* write-clear */
+
 /* Local timer */
 #define TIMER_ROUTE       (LOCAL_BASE + 0x24)
 #define TIMER_IRQ2CORE(i) (i)
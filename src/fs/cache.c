@@ -13,6 +13,7 @@ static const BlockDevice* device;
 
 #define MAX_LOG_BLOCKS 200 // Reserved space for logged blocks in `end_op`
 
+static struct kmem_cache* block_cache;
 static SpinLock lock;     // protects block cache.
 static ListNode head;     // the list of all allocated in-memory block.
 static LogHeader header;  // in-memory copy of log header block.
@@ -91,7 +92,7 @@ static bool try_evict_block(Block* target) {
     if (target == NULL) return false;
     ASSERT(target->acquired == false);
     _detach_from_list(&target->node);
-    kfree(target);
+    kmem_cache_free(block_cache, target);
     return true;
 }
 
@@ -148,7 +149,7 @@ static Block* cache_acquire(usize block_no) {
     }
     
     // Block not cached, read from device
-    target = kalloc(sizeof(Block));
+    target = kmem_cache_alloc(block_cache);
     init_block(target);
     target->block_no = block_no;
     device_read(target);
@@ -196,6 +197,8 @@ void init_bcache(const SuperBlock* _sblock, const BlockDevice* _device) {
     init_spinlock(&op_head_lock);
 
     // init head, lock and header
+    if (block_cache == NULL)
+        block_cache = kmem_cache_create("Block", sizeof(Block), NULL);
     init_list_node(&head);
     init_spinlock(&lock);
     memset(&header, 0, sizeof(LogHeader));
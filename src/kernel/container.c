@@ -10,8 +10,6 @@
 struct container root_container;
 extern struct proc root_proc;
 
-void activate_group(struct container* group);
-
 void set_container_to_this(struct proc* proc)
 {
     proc->container = thisproc()->container;
@@ -22,30 +20,34 @@ void init_container(struct container* container)
     memset(container, 0, sizeof(struct container));
     container->parent = NULL;
     container->rootproc = NULL;
-    init_schinfo(&container->schinfo, true);
-    init_schqueue(&container->schqueue);
+    for (int i = 0; i < NCPU; i++) {
+        init_schinfo(&container->schinfo[i], true);
+        init_schqueue(&container->schqueue[i]);
+        init_list_node(&container->throttled_node[i]);
+    }
+    init_spinlock(&container->bw_lock);
 
     init_list_node(&container->pid_head);
     container->max_pid = 0;
+    container->cpus_allowed = CPUMASK_ALL;
 }
 
 struct container* create_container(void (*root_entry)(), u64 arg)
 {
     struct proc* this = thisproc();
-    struct proc* new_rt = kalloc(sizeof(struct proc));
+    struct proc* new_rt = create_proc();
     struct container* new_con = kalloc(sizeof(struct container));
 
     init_container(new_con);
     new_con->parent = this->container;
     new_con->rootproc = new_rt;
     
-    init_proc(new_rt);
     set_parent_to_this(new_rt);
     new_rt->container = new_con;
 
-    // start_proc will add new_rt into new_con's sched queue
+    // start_proc will add new_rt into new_con's sched queue, which queues
+    // new_con in its parent's
     start_proc(new_rt, root_entry, arg);
-    activate_group(new_con);
     return new_con;
 }
 
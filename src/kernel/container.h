@@ -2,14 +2,33 @@
 
 #include <kernel/proc.h>
 #include <kernel/schinfo.h>
+#include <kernel/cpu.h>
 
 struct container
 {
     struct container* parent;
     struct proc* rootproc;
 
-    struct schinfo schinfo;
-    struct schqueue schqueue;
+    // One group entity in the parent's queue and one queue per cpu
+    struct schinfo schinfo[NCPU];
+    struct schqueue schqueue[NCPU];
+    // Cpus procs of this container may run on, narrowing their own masks
+    u64 cpus_allowed;
+    // Cycles run by procs of this container and its descendants
+    u64 cpu_time;
+
+    // Bandwidth limit: at most cfs_quota_ms of cpu time, summed over all
+    // cpus, every cfs_period_ms. A quota of 0 means no limit.
+    u64 cfs_quota_ms, cfs_period_ms;
+    // Guards the pool: cycles handed out in the period from bw_period_start
+    SpinLock bw_lock;
+    u64 bw_used, bw_period_start;
+    // Cycles of quota each cpu holds, under its run queue lock
+    u64 bw_local[NCPU];
+    // Out of quota on a cpu: the group entity is kept out of the parent's
+    // queue there until the next period
+    bool throttled[NCPU];
+    ListNode throttled_node[NCPU];
 
     // TODO: namespace (local pid?)
     ListNode pid_head;
@@ -18,4 +37,7 @@ struct container
 };
 
 struct container* create_container(void (*root_entry)(), u64 arg);
+// Cap the container at `quota_ms` of cpu time every `period_ms`, or lift
+// the cap with a quota of 0.
+void set_container_quota(struct container*, u64 quota_ms, u64 period_ms);
 void set_container_to_this(struct proc*);
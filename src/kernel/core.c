@@ -2,6 +2,7 @@
 #include <kernel/printk.h>
 #include <kernel/init.h>
 #include <kernel/sched.h>
+#include <kernel/mem.h>
 #include <test/test.h>
 #include <driver/sd.h>
 
@@ -14,7 +15,9 @@ NO_RETURN void idle_entry() {
         // yield();
         if (panic_flag)
             break;
-        if (cpuid() == 0) yield();
+        // Woken by an IPI or a timer with something queued here
+        if (cpus[cpuid()].sched.nr_running > 0) yield();
+        fill_zeroed_pages();
         arch_with_trap {
             arch_wfi();
         }
@@ -25,12 +28,26 @@ NO_RETURN void idle_entry() {
 
 extern void proc_test();
 
+// Also run the tests that only measure, or that take several seconds
+// spinning with interrupts off
+// #define DEBUG_RUN_SCHED_BENCHMARKS
+
 NO_RETURN void kernel_entry() {
     printk("hello world %d\n", (int)sizeof(struct proc));
 
     proc_test();
     user_proc_test();
     container_test();
+    sched_test();
+    share_test();
+    rt_test();
+    affinity_test();
+    quota_test();
+    pelt_test();
+    #ifdef DEBUG_RUN_SCHED_BENCHMARKS
+    sem_test();
+    tickless_test();
+    #endif
     // sd_test();
     
     do_rest_init();
@@ -5,6 +5,7 @@
 #include <kernel/sched.h>
 #include <kernel/proc.h>
 #include <aarch64/mmu.h>
+#include <driver/interrupt.h>
 
 struct cpu cpus[NCPU];
 
@@ -18,12 +19,17 @@ static bool __timer_cmp(rb_node lnode, rb_node rnode)
     return false;
 }
 
+// Longest countdown programmed at once; later deadlines take another round
+#define MAX_CLOCK_MS 10000
+
+// Program the clock for the earliest timer of this cpu, or stop it if
+// there is none, so that an idle cpu takes no ticks.
 static void __timer_set_clock()
 {
     auto node = _rb_first(&cpus[cpuid()].timer);
     if (!node)
     {
-        reset_clock(1000);
+        stop_clock();
         return;
     }
     auto t1 = container_of(node, struct timer, _node)->_key;
@@ -31,11 +37,11 @@ static void __timer_set_clock()
     if (t1 <= t0)
         reset_clock(0);
     else
-        reset_clock(t1 - t0);
+        reset_clock(MIN(t1 - t0, (u64) MAX_CLOCK_MS));
 }
 
 static void timer_clock_handler() {
-    reset_clock(1000);
+    __timer_set_clock();
     // printk("cpu %d aha\n", cpuid());
     while (1)
     {
@@ -70,6 +76,8 @@ void cancel_cpu_timer(struct timer* timer)
     __timer_set_clock();
 }
 
+// #define DEBUG_LOG_HELLOTIMER
+#ifdef DEBUG_LOG_HELLOTIMER
 static struct timer hello_timer[4];
 static void hello(struct timer* t)
 {
@@ -77,6 +85,7 @@ static void hello(struct timer* t)
     t->data++;
     set_cpu_timer(&hello_timer[cpuid()]);
 }
+#endif
 
 void set_cpu_on() {
     ASSERT(!_arch_disable_trap());
@@ -87,11 +96,14 @@ void set_cpu_on() {
     arch_set_vbar(exception_vector);
     arch_reset_esr();
     init_clock();
+    init_ipi();
     cpus[cpuid()].online = true;
     printk("CPU %d: hello\n", cpuid());
+    #ifdef DEBUG_LOG_HELLOTIMER
     hello_timer[cpuid()].elapse = 5000;
     hello_timer[cpuid()].handler = hello;
     set_cpu_timer(&hello_timer[cpuid()]);
+    #endif
 }
 
 void set_cpu_off() {
@@ -111,7 +123,7 @@ static void sched_timer_handler(struct timer* t) {
     #endif
 
     set_cpu_timer(&sched_timer[cpuid()]);
-    yield();
+    preempt();
     (void) t;
 }
 
@@ -119,7 +131,7 @@ static void sched_timer_handler(struct timer* t) {
 void setup_user_timer() {
     int cid = cpuid();
     sched_timer[cid].handler = sched_timer_handler;
-    // No less than 20, or may get stuck (Why??)
-    sched_timer[cid].elapse = 20;
+    // Re-armed with the proc's time slice on every switch
+    sched_timer[cid].elapse = sched_min_granularity_ms;
     set_cpu_timer(&sched_timer[cid]);
 }
@@ -18,6 +18,7 @@ struct timer
 struct cpu
 {
     bool online;
+    u64 nr_irqs;
     struct rb_root_ timer;
     struct sched sched;
 };
@@ -6,249 +6,1003 @@
 #include <common/spinlock.h>
 #include <common/checker.h>
 #include <common/string.h>
+#include <aarch64/intrinsic.h>
 #include <aarch64/mmu.h>
 #include <driver/memlayout.h>
+#include <kernel/syscall.h>
 
 // #define LOG_DEBUG_PAGE
-// #define LOG_DEBUG_BLOCK_MERGE
 // #define LOG_DEBUG_BLOCK
-
-// #define DO_PREV_MERGE
-//FIXME: emm..prev merge cannot work..
+// Remember the caller of every live kalloc()/kmem_cache_alloc() object,
+// so that kmem_stats_dump() can list who holds memory. Costs a locked
+// hash table update on every allocation and free.
+// #define KMEM_TRACK_CALLERS
 
 RefCount alloc_page_cnt;
+struct zone_stat zone_stat[NZONES];
+
+// Per-cpu allocator counters. Frees are charged to the cpu that frees, so
+// a single cpu's in-use figures can go negative; only the sums are exact.
+#define KMEM_NR_RANGES 5
+static const u32 kmem_range_limit[KMEM_NR_RANGES] = {64, 256, 1024, SLAB_MAX_SIZE, ~0u};
+static const char* const kmem_range_name[KMEM_NR_RANGES] = {
+    "<=64", "<=256", "<=1024", "<=slab", "large"};
+static const char* const page_tag_name[NR_PAGE_TAGS] = {
+    "other", "pgtable", "kstack", "ipc", "slab", "large"};
+
+static struct kmem_stat
+{
+    u64 nr_alloc, nr_free; // objects
+    i64 bytes[KMEM_NR_RANGES]; // object bytes in use by size range
+    i64 pages[NR_PAGE_TAGS];   // pages in use by tag
+} kmem_stat[4];
+
+static int kmem_range(u64 size)
+{
+    int i = 0;
+    while (size > kmem_range_limit[i])
+        i++;
+    return i;
+}
 
 define_early_init(alloc_page_cnt)
 {
     init_rc(&alloc_page_cnt);
 }
 
-static QueueNode* phead;
-int page_count;
 extern char end[];
 
+// Binary buddy allocator over the physical pages in [end, PHYSTOP).
+// A free block of order k is 2^k pages, aligned to 2^k pages in physical
+// memory. Its first page holds the ListNode linking it into free_area[k],
+// and buddy_order[] marks the head page of every free block with k + 1,
+// so the buddy of a freed block can be checked without touching it.
+// kalloc() marks the head page of its large blocks with BUDDY_LARGE | k,
+// which never matches a free block.
+//
+// The pages are split into NZONES contiguous zones, one per cpu, each with
+// its own free lists and lock. A cpu allocates from its own zone, and a
+// page always goes back to the zone its address falls in, so blocks never
+// merge across zones. A cpu whose zone has run dry steals from the zone
+// with the most free pages.
+#define NPAGES (PHYSTOP / PAGE_SIZE)
+#define PAGE_INDEX(p) (K2P(p) / PAGE_SIZE)
+#define INDEX_PAGE(i) ((void*) P2K((u64) (i) * PAGE_SIZE))
+
+struct zone
+{
+    SpinLock lock;
+    u64 start, end; // page index range
+    struct {
+        ListNode head;
+        u64 nr_free;
+    } free_area[MAX_ORDER];
+};
+
+static struct zone zones[NZONES];
+static u8 buddy_order[NPAGES];
+#define BUDDY_LARGE 0x80
+// enum page_tag of the head page of every allocated block
+static u8 page_tag[NPAGES];
+int page_count;
+
+static struct zone* page_zone(u64 idx)
+{
+    int i = NZONES - 1;
+    while (i > 0 && idx < zones[i].start)
+        i--;
+    return &zones[i];
+}
+
+static void buddy_insert(struct zone* z, u64 idx, int order)
+{
+    _insert_into_list(&z->free_area[order].head, (ListNode*) INDEX_PAGE(idx));
+    z->free_area[order].nr_free++;
+    zone_stat[z - zones].nr_free += 1ull << order;
+    buddy_order[idx] = order + 1;
+}
+
+static void buddy_remove(struct zone* z, u64 idx, int order)
+{
+    _detach_from_list((ListNode*) INDEX_PAGE(idx));
+    z->free_area[order].nr_free--;
+    zone_stat[z - zones].nr_free -= 1ull << order;
+    buddy_order[idx] = 0;
+}
+
+// Caller must hold z->lock.
+static void* _buddy_alloc(struct zone* z, int order)
+{
+    int k = order;
+    while (k < MAX_ORDER && _empty_list(&z->free_area[k].head))
+        k++;
+    if (k == MAX_ORDER)
+        return NULL;
+    u64 idx = PAGE_INDEX(z->free_area[k].head.next);
+    buddy_remove(z, idx, k);
+    // Split, returning the upper halves to the lower orders
+    while (k > order) {
+        k--;
+        buddy_insert(z, idx + (1ull << k), k);
+    }
+    zone_stat[z - zones].nr_alloc += 1ull << order;
+    return INDEX_PAGE(idx);
+}
+
+// Caller must hold z->lock, and `p` must lie in z.
+static void _buddy_free(struct zone* z, void* p, int order)
+{
+    u64 idx = PAGE_INDEX(p);
+    while (order < MAX_ORDER - 1) {
+        u64 buddy = idx ^ (1ull << order);
+        if (buddy < z->start || buddy >= z->end || buddy_order[buddy] != order + 1)
+            break;
+        buddy_remove(z, buddy, order);
+        idx &= ~(1ull << order);
+        order++;
+    }
+    buddy_insert(z, idx, order);
+}
+
+// The zone other than `self` with the most free pages, or NULL.
+static struct zone* steal_victim(struct zone* self)
+{
+    struct zone* v = NULL;
+    u64 best = 0;
+    for (int i = 0; i < NZONES; i++) {
+        u64 nr_free = __atomic_load_n(&zone_stat[i].nr_free, __ATOMIC_RELAXED);
+        if (&zones[i] != self && nr_free > best) {
+            best = nr_free;
+            v = &zones[i];
+        }
+    }
+    return v;
+}
+
+static void* buddy_alloc(int order)
+{
+    auto z = &zones[cpuid()];
+    _acquire_spinlock(&z->lock);
+    void* p = _buddy_alloc(z, order);
+    _release_spinlock(&z->lock);
+    if (p == NULL) {
+        auto v = steal_victim(z);
+        if (v == NULL)
+            return NULL;
+        _acquire_spinlock(&v->lock);
+        p = _buddy_alloc(v, order);
+        if (p)
+            zone_stat[v - zones].nr_stolen += 1ull << order;
+        _release_spinlock(&v->lock);
+    }
+    return p;
+}
+
+static void buddy_free(void* p, int order)
+{
+    auto z = page_zone(PAGE_INDEX(p));
+    _acquire_spinlock(&z->lock);
+    _buddy_free(z, p, order);
+    _release_spinlock(&z->lock);
+}
+
 define_early_init(page_list_init)
 {
-    for(u64 p = PAGE_BASE((u64) end) + PAGE_SIZE; p < P2K(PHYSTOP); p += PAGE_SIZE) {
-        add_to_queue(&phead, (QueueNode*) p);
-        page_count++;
+    u64 first = PAGE_INDEX(PAGE_BASE((u64) end) + PAGE_SIZE);
+    u64 span = NPAGES - first;
+    for (int i = 0; i < NZONES; i++) {
+        auto z = &zones[i];
+        init_spinlock(&z->lock);
+        for (int k = 0; k < MAX_ORDER; k++) {
+            init_list_node(&z->free_area[k].head);
+            z->free_area[k].nr_free = 0;
+        }
+        // Cut at max-order boundaries so no zone starts with small blocks
+        z->start = i ? round_down(first + span * i / NZONES, 1ull << (MAX_ORDER - 1)) : first;
+        if (i)
+            zones[i - 1].end = z->start;
+        memset(&zone_stat[i], 0, sizeof(struct zone_stat));
+    }
+    zones[NZONES - 1].end = NPAGES;
+    for (int i = 0; i < NZONES; i++) {
+        auto z = &zones[i];
+        u64 idx = z->start;
+        while (idx < z->end) {
+            int k = MAX_ORDER - 1;
+            while ((idx & ((1ull << k) - 1)) || idx + (1ull << k) > z->end)
+                k--;
+            buddy_insert(z, idx, k);
+            idx += 1ull << k;
+        }
+        zone_stat[i].nr_pages = z->end - z->start;
+        page_count += z->end - z->start;
     }
 }
 
-void* kalloc_page()
+static void* set_page_tag(void* p, int order, enum page_tag tag)
+{
+    page_tag[PAGE_INDEX(p)] = tag;
+    kmem_stat[cpuid()].pages[tag] += 1ll << order;
+    return p;
+}
+
+static void* _kalloc_pages(int order, enum page_tag tag)
+{
+    ASSERT(order >= 0 && order < MAX_ORDER);
+    if (order == 0)
+        return kalloc_page_tagged(tag);
+    void* p = buddy_alloc(order);
+    if (p == NULL)
+        return NULL;
+    __atomic_fetch_add(&alloc_page_cnt.count, 1ll << order, __ATOMIC_ACQ_REL);
+    memset(p, 0, PAGE_SIZE << order);
+    return set_page_tag(p, order, tag);
+}
+
+void* kalloc_pages(int order)
+{
+    return _kalloc_pages(order, PAGE_TAG_OTHER);
+}
+
+void kfree_pages(void* p, int order)
+{
+    ASSERT(order >= 0 && order < MAX_ORDER);
+    if (order == 0) {
+        kfree_page(p);
+        return;
+    }
+    ASSERT((PAGE_INDEX(p) & ((1ull << order) - 1)) == 0);
+    __atomic_fetch_sub(&alloc_page_cnt.count, 1ll << order, __ATOMIC_ACQ_REL);
+    kmem_stat[cpuid()].pages[page_tag[PAGE_INDEX(p)]] -= 1ll << order;
+    buddy_free(p, order);
+}
+
+void buddy_stat(u64 nr_free[MAX_ORDER])
+{
+    for (int k = 0; k < MAX_ORDER; k++)
+        nr_free[k] = 0;
+    for (int i = 0; i < NZONES; i++) {
+        auto z = &zones[i];
+        _acquire_spinlock(&z->lock);
+        for (int k = 0; k < MAX_ORDER; k++)
+            nr_free[k] += z->free_area[k].nr_free;
+        _release_spinlock(&z->lock);
+    }
+}
+
+// Per-CPU page cache in front of the buddy allocator.
+// Pages are refilled from / drained to the buddy allocator in batches so
+// that a zone lock is taken once per batch instead of once per page.
+// `zeroed` is a separate pool of pages cleared ahead of time by the idle
+// loop, so that kalloc_page() can usually skip the memset.
+struct page_cache
+{
+    int count;
+    int nr_zeroed;
+    void* pages[PAGE_CACHE_SIZE];
+    void* zeroed[ZERO_POOL_SIZE];
+    u64 zero_hit, zero_miss;
+    u64 zero_cycles; // time spent in memset on misses
+};
+
+static struct page_cache page_cache[4];
+bool page_cache_enabled;
+
+define_early_init(page_cache_init)
+{
+    for (int i = 0; i < 4; i++)
+        memset(&page_cache[i], 0, sizeof(struct page_cache));
+    page_cache_enabled = true;
+}
+
+// Move up to `n` order-0 pages from zone `z` into the cache. Pages taken
+// from another cpu's zone count as stolen.
+static int page_cache_take(struct page_cache* pc, struct zone* z, int n)
+{
+    int got = 0;
+    _acquire_spinlock(&z->lock);
+    while (got < n && pc->count < PAGE_CACHE_SIZE) {
+        void* p = _buddy_alloc(z, 0);
+        if (p == NULL)
+            break;
+        pc->pages[pc->count++] = p;
+        got++;
+    }
+    if (z != &zones[cpuid()])
+        zone_stat[z - zones].nr_stolen += got;
+    _release_spinlock(&z->lock);
+    return got;
+}
+
+// Take up to `n` order-0 pages from this cpu's zone into the cache. If the
+// zone is empty, steal half of the free pages of the fullest zone, but no
+// more than `n`.
+static void page_cache_refill(struct page_cache* pc, int n)
+{
+    auto z = &zones[cpuid()];
+    if (page_cache_take(pc, z, n) > 0)
+        return;
+    auto v = steal_victim(z);
+    if (v == NULL)
+        return;
+    u64 half = (zone_stat[v - zones].nr_free + 1) / 2;
+    page_cache_take(pc, v, MIN((u64) n, half));
+}
+
+// Give `n` pages back to their home zones, switching locks only when the
+// zone changes.
+static void free_page_batch(void** pages, int n)
+{
+    struct zone* held = NULL;
+    for (int i = 0; i < n; i++) {
+        auto z = page_zone(PAGE_INDEX(pages[i]));
+        if (z != held) {
+            if (held)
+                _release_spinlock(&held->lock);
+            _acquire_spinlock(&z->lock);
+            held = z;
+        }
+        _buddy_free(z, pages[i], 0);
+    }
+    if (held)
+        _release_spinlock(&held->lock);
+}
+
+// Return pages above `target` to the buddy allocator.
+static void page_cache_drain_to(struct page_cache* pc, int target)
+{
+    if (pc->count <= target)
+        return;
+    free_page_batch(&pc->pages[target], pc->count - target);
+    pc->count = target;
+}
+
+void page_cache_drain()
+{
+    auto pc = &page_cache[cpuid()];
+    free_page_batch(pc->zeroed, pc->nr_zeroed);
+    pc->nr_zeroed = 0;
+    page_cache_drain_to(pc, 0);
+}
+
+// Get a page with unspecified content, without touching alloc_page_cnt.
+static void* _kalloc_page_raw(struct page_cache* pc)
+{
+    void *p;
+    if (page_cache_enabled) {
+        if (pc->count == 0)
+            page_cache_refill(pc, PAGE_CACHE_LOW);
+        p = pc->count ? pc->pages[--pc->count] : NULL;
+    } else {
+        p = buddy_alloc(0);
+    }
+    return p;
+}
+
+void fill_zeroed_pages()
+{
+    if (!page_cache_enabled)
+        return;
+    auto pc = &page_cache[cpuid()];
+    for (int i = 0; i < ZERO_POOL_BATCH && pc->nr_zeroed < ZERO_POOL_SIZE; i++) {
+        void* p = _kalloc_page_raw(pc);
+        if (p == NULL)
+            break;
+        memset(p, 0, PAGE_SIZE);
+        pc->zeroed[pc->nr_zeroed++] = p;
+    }
+}
+
+void* kalloc_page_tagged(enum page_tag tag)
 {
     _increment_rc(&alloc_page_cnt);
-    QueueNode *p = fetch_from_queue(&phead);
+    auto pc = &page_cache[cpuid()];
+    if (page_cache_enabled && pc->nr_zeroed > 0) {
+        pc->zero_hit++;
+        return set_page_tag(pc->zeroed[--pc->nr_zeroed], 0, tag);
+    }
+    void *p = _kalloc_page_raw(pc);
     ASSERT(p);
 
     #ifdef LOG_DEBUG_PAGE
     printk("(CPU %d) Allocated new page at %llx\n", cpuid(), (u64) p);
     #endif
     
-    memset((void*) p, 0, PAGE_SIZE);
-    return (void*) p;
+    u64 t = get_timestamp();
+    memset(p, 0, PAGE_SIZE);
+    pc->zero_cycles += get_timestamp() - t;
+    pc->zero_miss++;
+    return set_page_tag(p, 0, tag);
+}
+
+void* kalloc_page()
+{
+    return kalloc_page_tagged(PAGE_TAG_OTHER);
+}
+
+void* kalloc_page_nozero_tagged(enum page_tag tag)
+{
+    _increment_rc(&alloc_page_cnt);
+    auto pc = &page_cache[cpuid()];
+    void *p = _kalloc_page_raw(pc);
+    // Fall back to a zeroed page rather than failing
+    if (p == NULL && pc->nr_zeroed > 0)
+        p = pc->zeroed[--pc->nr_zeroed];
+    ASSERT(p);
+    return set_page_tag(p, 0, tag);
+}
+
+void* kalloc_page_nozero()
+{
+    return kalloc_page_nozero_tagged(PAGE_TAG_OTHER);
 }
 
 void kfree_page(void* p)
 {
     _decrement_rc(&alloc_page_cnt);
-    add_to_queue(&phead, (QueueNode*) PAGE_BASE((u64) p));
+    p = (void*) PAGE_BASE((u64) p);
+    kmem_stat[cpuid()].pages[page_tag[PAGE_INDEX(p)]]--;
+    if (page_cache_enabled) {
+        auto pc = &page_cache[cpuid()];
+        pc->pages[pc->count++] = p;
+        if (pc->count > PAGE_CACHE_HIGH)
+            page_cache_drain_to(pc, PAGE_CACHE_LOW);
+    } else {
+        buddy_free(p, 0);
+    }
 
     #ifdef LOG_DEBUG_PAGE
-    printk("Freed page %llx\n", PAGE_BASE((u64) p));
+    printk("Freed page %llx\n", (u64) p);
     #endif
 }
 
-struct Page_Info
+void page_zero_report()
+{
+    for (int i = 0; i < 4; i++) {
+        auto pc = &page_cache[i];
+        u64 total = pc->zero_hit + pc->zero_miss;
+        u64 per_zero = pc->zero_miss ? pc->zero_cycles / pc->zero_miss : 0;
+        printk("CPU %d: pre-zeroed pool hit %llu/%llu (%llu%%), %llu cycles per memset, "
+               "~%llu cycles saved per allocation\n",
+               i, pc->zero_hit, total, total ? pc->zero_hit * 100 / total : 0, per_zero,
+               total ? per_zero * pc->zero_hit / total : 0);
+    }
+}
+
+// Slab allocator behind kmem_cache_alloc() and kalloc().
+// A slab is one page: a 16-byte header followed by equally sized object
+// slots. Every slot has an 8-byte link word: a free slot keeps there the
+// page offset of the next free slot in its slab, or the next object on a
+// remote free list. Objects carry no header and kfree() finds the slab with
+// PAGE_BASE(p). The link sits at the start of the slot, or right after
+// the object for caches with a constructor, so that freed objects keep
+// their constructed state.
+//
+// A slab belongs to the cpu that created it, and only that cpu touches its
+// free list and its cache's slab lists, so none of them needs a lock. Other
+// cpus hand objects back through a lock-free per-cpu remote list, which
+// the owner reclaims in one batch when it runs out of free objects.
+//
+// The owner keeps partially used slabs and completely free slabs on two
+// lists, linked by page index. Once it holds more than SLAB_EMPTY_HIGH
+// free slabs of a cache, it returns them to the page allocator until only
+// SLAB_EMPTY_LOW are left.
+struct slab
 {
-    struct Page_Info *next_page;
-    u32 max_size;
-    SpinLock page_lock;
+    u32 next, prev;    // page index of the neighbours on the owner's list, 0 if none
+    u16 free;          // page offset of the first free slot, 0 if full
+    u16 inuse;
+    u8 cache;          // index into kmem_caches[]
+    u8 cpu;            // owner cpu
 };
+_Static_assert(sizeof(struct slab) <= SLAB_HEADER_SIZE, "slab header size");
 
-struct Block_Info
+#define SLAB_INDEX(s) ((u32) PAGE_INDEX(s))
+#define INDEX_SLAB(i) ((struct slab*) INDEX_PAGE(i))
+
+// Per-cpu stack of free objects in front of the slabs.
+struct kmem_cpu_cache
 {
-    struct Block_Info *prev;
-    u32 size;
-    u8 used;
+    u32 count;
+    void* objs[KMEM_CPU_CACHE_SIZE];
 };
 
-static struct Page_Info *first_page[4];
-static SpinLock fp_lock[4];
+struct kmem_cache
+{
+    const char* name;
+    u32 size;    // object size
+    u32 stride;  // distance between slots
+    u32 link;    // offset of the free-list link inside a slot
+    u32 nr_objs; // slots per slab
+    u32 range;   // kmem_stat size range
+    void (*ctor)(void*);
+    struct kmem_cpu_cache cpu[4];
+    // slab lists of each owner cpu, as page indices
+    u32 partial[4];
+    u32 empty[4];
+    u32 nr_empty[4];
+    u32 nr_slabs[4];
+    u32 nr_inuse[4]; // objects handed out of the slabs of each cpu
+    // objects freed by other cpus into slabs owned by each cpu
+    void* remote[4];
+};
 
-define_early_init(first_page_init) {
-    for(int i = 0; i < 4; i++) {
-        first_page[i] = 0;
-        init_spinlock(&fp_lock[i]);
+static struct kmem_cache kmem_caches[KMEM_MAX_CACHES];
+static int nr_kmem_caches;
+static SpinLock kmem_caches_lock;
+bool kmem_cpu_cache_enabled;
+
+struct kmem_cache* kmem_cache_create(const char* name, u32 size, void (*ctor)(void*))
+{
+    ASSERT(size > 0 && size <= SLAB_MAX_SIZE);
+    _acquire_spinlock(&kmem_caches_lock);
+    ASSERT(nr_kmem_caches < KMEM_MAX_CACHES);
+    auto c = &kmem_caches[nr_kmem_caches++];
+    _release_spinlock(&kmem_caches_lock);
+
+    memset(c, 0, sizeof(struct kmem_cache));
+    c->name = name;
+    c->size = size;
+    c->ctor = ctor;
+    if (ctor) {
+        c->link = round_up(size, 8);
+        c->stride = c->link + 8;
+    } else {
+        c->link = 0;
+        c->stride = round_up(size, 8);
     }
+    c->nr_objs = (PAGE_SIZE - SLAB_HEADER_SIZE) / c->stride;
+    ASSERT(c->nr_objs > 0);
+    c->range = kmem_range(size);
+    return c;
 }
 
-void* kalloc(isize _size)
+#define SLOT_LINK(c, s, off) ((u16*) ((u64) (s) + (off) + (c)->link))
+#define REMOTE_LINK(c, p) ((void**) ((u64) (p) + (c)->link))
+
+static void slab_list_add(u32* head, struct slab* s)
 {
-    ASSERT(_size > 0);
-    ASSERT((u64) _size <= PAGE_SIZE - sizeof(struct Page_Info) - sizeof(struct Block_Info));
-    // Always align to 8 bytes
-    u64 size = (_size % 8) ? (_size / 8 + 1) * 8 : _size;
-    struct Block_Info *blk;
-    struct Page_Info* pg;
-    int cid = cpuid();
-    // _acquire_spinlock(&fp_lock[cid]);
-
-    // Find a page with enough max_size
-    setup_checker(chk1);
-    for (pg = first_page[cid]; pg != 0; pg = pg->next_page) {
-        acquire_spinlock(chk1, &(pg->page_lock));
-        if ((u64) pg->max_size >= size) {
-            // Found an available page, now try to find a block
-            for (blk = (struct Block_Info*)(pg + 1); 
-                ((u64) blk->size < size || blk->used != 0); 
-                blk = (struct Block_Info*)((u64) (blk + 1) + (u64) blk->size));
-
-            // Now, blk should point to an available block with enough size
-            int need_update = blk->size == pg->max_size;
-            if ((u64) blk->size - size <= sizeof(struct Block_Info)) {
-                blk->used = 1;
-            } else {
-                auto nblk = (struct Block_Info*) ((u64) (blk + 1) + size);
-                nblk->size = (u64) blk->size - sizeof(struct Block_Info) - size;
-                nblk->used = 0;
-                nblk->prev = blk;
-                blk->used = 1;
-                blk->size = size;
-            }
+    s->prev = 0;
+    s->next = *head;
+    if (*head)
+        INDEX_SLAB(*head)->prev = SLAB_INDEX(s);
+    *head = SLAB_INDEX(s);
+}
+
+static void slab_list_del(u32* head, struct slab* s)
+{
+    if (s->prev)
+        INDEX_SLAB(s->prev)->next = s->next;
+    else
+        *head = s->next;
+    if (s->next)
+        INDEX_SLAB(s->next)->prev = s->prev;
+}
+
+static struct slab* new_slab(struct kmem_cache* c, int cid)
+{
+    auto s = (struct slab*) kalloc_page_tagged(PAGE_TAG_SLAB);
+    s->inuse = 0;
+    s->cache = c - kmem_caches;
+    s->cpu = cid;
+    // Thread the free list through the slots in address order
+    u64 off = SLAB_HEADER_SIZE;
+    s->free = off;
+    for (u32 i = 0; i < c->nr_objs; i++, off += c->stride) {
+        if (c->ctor)
+            c->ctor((void*) ((u64) s + off));
+        *SLOT_LINK(c, s, off) = (i + 1 < c->nr_objs) ? off + c->stride : 0;
+    }
+    c->nr_slabs[cid]++;
+    return s;
+}
 
-            // Update max_size of this page
-            if (need_update) {
-                pg->max_size = 0;
-                for (auto b = (struct Block_Info*)(pg + 1); (u64) b < (u64)(pg) + PAGE_SIZE; b = (struct Block_Info*) ((u64) (b + 1) + b->size)) {
-                    if (b->used == 0) {
-                        pg->max_size = MAX(b->size, pg->max_size);
-                    }
-                }
+// Return `p` to its slab. Only the owner of the slab may call this.
+static void slab_free_local(struct kmem_cache* c, struct slab* s, void* p)
+{
+    int cid = s->cpu;
+    u16 off = (u64) p - (u64) s;
+    bool was_full = s->free == 0;
+    *SLOT_LINK(c, s, off) = s->free;
+    s->free = off;
+    s->inuse--;
+    c->nr_inuse[cid]--;
+
+    if (s->inuse == 0) {
+        if (!was_full)
+            slab_list_del(&c->partial[cid], s);
+        slab_list_add(&c->empty[cid], s);
+        if (++c->nr_empty[cid] > SLAB_EMPTY_HIGH) {
+            while (c->nr_empty[cid] > SLAB_EMPTY_LOW) {
+                auto e = INDEX_SLAB(c->empty[cid]);
+                slab_list_del(&c->empty[cid], e);
+                c->nr_empty[cid]--;
+                c->nr_slabs[cid]--;
+                kfree_page(e);
             }
-            #ifdef LOG_DEBUG_BLOCK
-            printk("AB %llx with size %lld, page max_size now %lld\n", (u64) (blk), (u64) blk->size, (u64) pg->max_size);
-            #endif
+        }
+    } else if (was_full) {
+        // A full slab is on no list until something is freed into it
+        slab_list_add(&c->partial[cid], s);
+    }
+}
+
+// Take back every object other cpus have freed into our slabs.
+static void slab_reclaim_remote(struct kmem_cache* c, int cid)
+{
+    if (__atomic_load_n(&c->remote[cid], __ATOMIC_RELAXED) == NULL)
+        return;
+    void* p = __atomic_exchange_n(&c->remote[cid], NULL, __ATOMIC_ACQUIRE);
+    while (p) {
+        void* next = *REMOTE_LINK(c, p);
+        slab_free_local(c, (struct slab*) PAGE_BASE((u64) p), p);
+        p = next;
+    }
+}
 
-            // _release_spinlock(&fp_lock[cid]);
-            release_spinlock(chk1, &(pg->page_lock));
-            return (void*)(blk + 1);
+// Pop up to `n` objects from this cpu's slabs into `objs`.
+static int slab_alloc(struct kmem_cache* c, void** objs, int n)
+{
+    int cid = cpuid(), got = 0;
+    if (c->partial[cid] == 0)
+        slab_reclaim_remote(c, cid);
+    while (got < n) {
+        struct slab* s;
+        if (c->partial[cid]) {
+            s = INDEX_SLAB(c->partial[cid]);
+        } else {
+            if (c->empty[cid]) {
+                s = INDEX_SLAB(c->empty[cid]);
+                slab_list_del(&c->empty[cid], s);
+                c->nr_empty[cid]--;
+            } else {
+                s = new_slab(c, cid);
+            }
+            slab_list_add(&c->partial[cid], s);
+        }
+        while (got < n && s->free) {
+            objs[got++] = (void*) ((u64) s + s->free);
+            s->free = *SLOT_LINK(c, s, s->free);
+            s->inuse++;
+            c->nr_inuse[cid]++;
         }
+        if (s->free == 0)
+            slab_list_del(&c->partial[cid], s);
+    }
+    return got;
+}
 
-        // Reach the last page, and still failed to find enough space
-        if (pg->next_page == 0) {
-            #ifdef LOG_DEBUG_PAGE
-            printk("(CPU %d) Reach last page %llx with max size %lld\n", cid, (u64) pg, (u64) pg->max_size);
-            #endif
+static void slab_free(struct kmem_cache* c, void* p)
+{
+    auto s = (struct slab*) PAGE_BASE((u64) p);
+    if (s->cpu == cpuid()) {
+        slab_free_local(c, s, p);
+        return;
+    }
+    // Push onto the owner's remote list. Only the owner takes from it, and
+    // it always takes the whole list, so a plain CAS push has no ABA issue.
+    void** head = &c->remote[s->cpu];
+    void* old = __atomic_load_n(head, __ATOMIC_RELAXED);
+    do
+        *REMOTE_LINK(c, p) = old;
+    while (!__atomic_compare_exchange_n(head, &old, p, true, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+}
 
-            release_spinlock(chk1, &(pg->page_lock));
-            break;
+#ifdef KMEM_TRACK_CALLERS
+// Open-addressing table of live objects, keyed by address.
+#define TRACK_SLOTS 8192
+#define TRACK_DEAD ((void*) 1)
+
+static struct
+{
+    void* p;
+    void* caller;
+    u32 size;
+} track[TRACK_SLOTS];
+static u64 track_dropped;
+static SpinLock track_lock;
+
+static u32 track_hash(void* p)
+{
+    return ((u64) p >> 3) * 0x9E3779B97F4A7C15ull >> 51;
+}
+
+static void track_alloc(void* p, u32 size, void* caller)
+{
+    _acquire_spinlock(&track_lock);
+    u32 h = track_hash(p);
+    for (int i = 0; i < TRACK_SLOTS; i++, h = (h + 1) % TRACK_SLOTS) {
+        if (track[h].p == NULL || track[h].p == TRACK_DEAD) {
+            track[h].p = p;
+            track[h].caller = caller;
+            track[h].size = size;
+            _release_spinlock(&track_lock);
+            return;
         }
-        release_spinlock(chk1, &(pg->page_lock));
     }
+    track_dropped++;
+    _release_spinlock(&track_lock);
+}
 
-    // Need a new page
-    struct Page_Info *old_page = pg;
-    pg = (struct Page_Info*) kalloc_page();
-    ASSERT(pg);
-    pg->max_size = PAGE_SIZE - sizeof(struct Page_Info) - sizeof(struct Block_Info);
-    pg->next_page = NULL;
-    init_spinlock(&(pg->page_lock));
+static void track_free(void* p)
+{
+    _acquire_spinlock(&track_lock);
+    u32 h = track_hash(p);
+    for (int i = 0; i < TRACK_SLOTS && track[h].p; i++, h = (h + 1) % TRACK_SLOTS) {
+        if (track[h].p == p) {
+            track[h].p = TRACK_DEAD;
+            break;
+        }
+    }
+    _release_spinlock(&track_lock);
+}
+#else
+#define track_alloc(p, size, caller) ((void) 0)
+#define track_free(p) ((void) 0)
+#endif
 
-    blk = (struct Block_Info*) (pg + 1);
-    blk->prev = blk;
-    blk->size = pg->max_size;
-    blk->used = 0;
-    
-    // Divide blk into (size) and another empty block
-    if ((u64) blk->size - size <= sizeof(struct Block_Info)) {
-        blk->used = 1;
-        pg->max_size = 0;
+static void* _kmem_cache_alloc(struct kmem_cache* c)
+{
+    void* p;
+    if (kmem_cpu_cache_enabled) {
+        auto cc = &c->cpu[cpuid()];
+        if (cc->count == 0)
+            cc->count = slab_alloc(c, cc->objs, KMEM_CPU_CACHE_BATCH);
+        p = cc->objs[--cc->count];
     } else {
-        auto nblk = (struct Block_Info*) ((u64) (blk + 1) + size);
-        nblk->size = (u64) blk->size - sizeof(struct Block_Info) - size;
-        nblk->used = 0;
-        nblk->prev = blk;
-        blk->used = 1;
-        blk->size = size;
-        pg->max_size = nblk->size;
+        slab_alloc(c, &p, 1);
     }
+    auto st = &kmem_stat[cpuid()];
+    st->nr_alloc++;
+    st->bytes[c->range] += c->size;
 
-    if (first_page[cid] == 0) {
-        first_page[cid] = pg;
-    }
-    else {
-        ASSERT(old_page);
-        old_page->next_page = pg;
+    #ifdef LOG_DEBUG_BLOCK
+    printk("AB %llx from cache %s\n", (u64) p, c->name);
+    #endif
+    return p;
+}
+
+void* kmem_cache_alloc(struct kmem_cache* c)
+{
+    void* p = _kmem_cache_alloc(c);
+    track_alloc(p, c->size, __builtin_return_address(0));
+    return p;
+}
+
+static void _kmem_cache_free(struct kmem_cache* c, void* p)
+{
+    ASSERT(&kmem_caches[((struct slab*) PAGE_BASE((u64) p))->cache] == c);
+    auto st = &kmem_stat[cpuid()];
+    st->nr_free++;
+    st->bytes[c->range] -= c->size;
+    if (kmem_cpu_cache_enabled) {
+        auto cc = &c->cpu[cpuid()];
+        if (cc->count == KMEM_CPU_CACHE_SIZE) {
+            // Return the coldest batch to the slabs
+            for (int i = 0; i < KMEM_CPU_CACHE_BATCH; i++)
+                slab_free(c, cc->objs[i]);
+            cc->count -= KMEM_CPU_CACHE_BATCH;
+            memmove(cc->objs, cc->objs + KMEM_CPU_CACHE_BATCH, cc->count * sizeof(void*));
+        }
+        cc->objs[cc->count++] = p;
+    } else {
+        slab_free(c, p);
     }
 
     #ifdef LOG_DEBUG_BLOCK
-    printk("AB %llx of size %lld in new page %llx, page max_size now %lld\n", (u64) (blk), (u64) blk->size, (u64) pg, (u64) pg->max_size);
+    printk("...Freed block %llx\n", (u64) p);
     #endif
-    // _release_spinlock(&fp_lock[cid]);
-    return (void*)(blk + 1);
 }
 
+void kmem_cache_free(struct kmem_cache* c, void* p)
+{
+    track_free(p);
+    _kmem_cache_free(c, p);
+}
 
+// kalloc() size classes, tuned so that the tail of a slab wastes little space
+static const u32 slab_sizes[] = {
+    8, 16, 24, 32, 48, 64, 80, 96, 128, 160, 192, 256, 336, 408,
+    512, 680, 816, 1016, 1360, 2040, 4080,
+};
+#define NR_SLAB_SIZES (int) (sizeof(slab_sizes) / sizeof(slab_sizes[0]))
 
-void kfree(void* p)
+static struct kmem_cache* size_caches[NR_SLAB_SIZES];
+// size_class[(size + 7) / 8] is the smallest class holding `size` bytes
+static u8 size_class[SLAB_MAX_SIZE / 8 + 1];
+
+define_early_init(kmem_caches_init)
 {
-    setup_checker(chk2);
-    u64 pb = PAGE_BASE((u64) p);
-    auto pg = (struct Page_Info*) pb;
-    acquire_spinlock(chk2, &(pg->page_lock));
-    struct Block_Info* blk = (struct Block_Info*)((u64) p - sizeof(struct Block_Info));
-    struct Block_Info *prev = blk->prev;
-    struct Block_Info *next = (struct Block_Info*)((u64) (blk + 1) + (u64) blk->size);
-    blk->used = 0;
-    // prevent unused variable warning..
-    (void)next;
-    (void)prev;
-
-    #ifdef LOG_DEBUG_BLOCK_MERGE
-    printk("Freeing block %llx size %lld...\n", (u64) blk, (u64) blk->size);
-    if ((u64) next < pb + PAGE_SIZE) printk("...Next block %llx size %lld, used = %d\n", (u64) next, (u64) next->size, next->used);
-    printk("...Previous block %llx size %lld, used = %d\n", (u64) prev, (u64) prev->size, prev->used);
-    #endif
+    init_spinlock(&kmem_caches_lock);
+    kmem_cpu_cache_enabled = true;
+    int k = 0;
+    for (int i = 0; i < NR_SLAB_SIZES; i++) {
+        size_caches[i] = kmem_cache_create("kalloc", slab_sizes[i], NULL);
+        for (; k <= (int) (slab_sizes[i] / 8); k++)
+            size_class[k] = i;
+    }
+}
 
-    // Check if next is empty
-    if ((u64) next < pb + PAGE_SIZE && next->used == 0) {
-        blk->size += next->size + sizeof(struct Block_Info);
-        auto nnext = (struct Block_Info*) ((u64) (next + 1) + (u64) next->size);
-        if ((u64) nnext < pb + PAGE_SIZE) {
-            nnext->prev = blk;
-        }
+// Blocks too large for a slab get whole pages from the buddy allocator.
+// They are page aligned while slab objects never are, so kfree() tells
+// them apart by the address alone.
+static void* kalloc_large(u64 size)
+{
+    int order = 0;
+    while (((u64) PAGE_SIZE << order) < size)
+        order++;
+    ASSERT(order < MAX_ORDER);
+    void* p = _kalloc_pages(order, PAGE_TAG_LARGE);
+    if (p) {
+        buddy_order[PAGE_INDEX(p)] = BUDDY_LARGE | order;
+        auto st = &kmem_stat[cpuid()];
+        st->nr_alloc++;
+        st->bytes[KMEM_NR_RANGES - 1] += PAGE_SIZE << order;
+    }
+    return p;
+}
 
-        #ifdef LOG_DEBUG_BLOCK_MERGE
-        printk("...MN Next block %llx size %lld, merged into block %llx new size %lld\n", (u64) next, (u64) next->size, (u64) blk, (u64) blk->size);
-        #endif
+static void kfree_large(void* p)
+{
+    u64 idx = PAGE_INDEX(p);
+    ASSERT(buddy_order[idx] & BUDDY_LARGE);
+    int order = buddy_order[idx] & ~BUDDY_LARGE;
+    buddy_order[idx] = 0;
+    auto st = &kmem_stat[cpuid()];
+    st->nr_free++;
+    st->bytes[KMEM_NR_RANGES - 1] -= PAGE_SIZE << order;
+    kfree_pages(p, order);
+}
+
+void* kalloc(isize _size)
+{
+    ASSERT(_size > 0);
+    void* p;
+    if ((u64) _size > SLAB_MAX_SIZE)
+        p = kalloc_large(_size);
+    else
+        p = _kmem_cache_alloc(size_caches[size_class[(_size + 7) / 8]]);
+    if (p)
+        track_alloc(p, _size, __builtin_return_address(0));
+    return p;
+}
+
+void kfree(void* p)
+{
+    track_free(p);
+    auto s = (struct slab*) PAGE_BASE((u64) p);
+    if ((void*) s == p) {
+        kfree_large(p);
+        return;
     }
+    _kmem_cache_free(&kmem_caches[s->cache], p);
+}
 
-    #ifdef DO_PREV_MERGE
-    // Check if prev is empty
-    next = (struct Block_Info*)((u64) (blk + 1) + (u64) blk->size);
-    if (prev != blk && prev->used == 0) {
-        printk("...Blk at %llx, prev at %llx\n", (u64) blk, (u64) blk->prev);
-        prev->size += blk->size + sizeof(struct Block_Info);
-        if ((u64) next < pb + PAGE_SIZE) {
-            next->prev = prev;
-        }
+void kmem_drain()
+{
+    int cid = cpuid();
+    for (int i = 0; i < nr_kmem_caches; i++) {
+        auto c = &kmem_caches[i];
+        auto cc = &c->cpu[cid];
+        while (cc->count > 0)
+            slab_free(c, cc->objs[--cc->count]);
+        slab_reclaim_remote(c, cid);
+    }
+}
 
-        #ifdef LOG_DEBUG_BLOCK_MERGE
-        printk("...MP Block size is %lld, prev block is %llx new size %lld\n", (u64) blk->size, (u64) prev, (u64) prev->size);
-        #endif
+void kmem_report()
+{
+    // A cpu caches objects of any cpu's slabs, so cached bytes are only
+    // reported as a total. They are part of the used bytes of their owners.
+    u64 cached = 0;
+    for (int cid = 0; cid < 4; cid++) {
+        u64 used = 0, free = 0, largest = 0, slabs = 0;
+        for (int i = 0; i < nr_kmem_caches; i++) {
+            auto c = &kmem_caches[i];
+            u64 nr_free = (u64) c->nr_slabs[cid] * c->nr_objs - c->nr_inuse[cid];
+            used += (u64) c->nr_inuse[cid] * c->size;
+            free += nr_free * c->size;
+            cached += (u64) c->cpu[cid].count * c->size;
+            slabs += c->nr_slabs[cid];
+            // Objects never straddle slabs, so the largest free block is the
+            // largest object size that still has a free slot.
+            if (nr_free > 0)
+                largest = MAX(largest, (u64) c->size);
+        }
+        printk("CPU %d: %llu slabs, used %llu bytes, free %llu bytes, "
+               "largest free block %llu bytes\n",
+               cid, slabs, used, free, largest);
     }
-    #endif
+    printk("%llu used bytes held in per-cpu caches\n", cached);
+}
 
-    // Update max_size of this page
-    pg->max_size = MAX(pg->max_size, blk->size);
+#ifdef KMEM_TRACK_CALLERS
+// Sum the live tracked objects by call site and print the biggest holders.
+static void track_dump()
+{
+    static struct {
+        void* caller;
+        u64 count, bytes;
+    } sites[32];
+    int n = 0;
+    u64 other = 0;
+    _acquire_spinlock(&track_lock);
+    for (int i = 0; i < TRACK_SLOTS; i++) {
+        if (track[i].p == NULL || track[i].p == TRACK_DEAD)
+            continue;
+        int j = 0;
+        while (j < n && sites[j].caller != track[i].caller)
+            j++;
+        if (j == n) {
+            if (n == 32) {
+                other += track[i].size;
+                continue;
+            }
+            sites[n].caller = track[i].caller;
+            sites[n].count = sites[n].bytes = 0;
+            n++;
+        }
+        sites[j].count++;
+        sites[j].bytes += track[i].size;
+    }
+    _release_spinlock(&track_lock);
+    for (int j = 0; j < n; j++)
+        printk("  caller %p: %llu objects, %llu bytes\n", sites[j].caller, sites[j].count,
+               sites[j].bytes);
+    if (other || track_dropped)
+        printk("  %llu bytes from other callers, %llu objects not tracked\n", other, track_dropped);
+}
+#endif
 
-    // if (pg->max_size == PAGE_SIZE - sizeof(struct Page_Info) - sizeof(struct Block_Info)) {
-    //     kfree_page((void*) pg);
-    // }
-    release_spinlock(chk2, &(pg->page_lock));
+i64 kmem_cache_inuse(struct kmem_cache* c)
+{
+    // A cpu caches objects it freed whatever slab they belong to, so its
+    // cached count may exceed the objects handed out of its own slabs:
+    // only the totals match.
+    i64 handed_out = 0, cached = 0;
+    for (int cid = 0; cid < 4; cid++) {
+        handed_out += c->nr_inuse[cid];
+        cached += c->cpu[cid].count;
+    }
+    return handed_out - cached;
+}
 
-    #ifdef LOG_DEBUG_BLOCK
-    printk("...Freed block %llx\n", (u64) blk);
+void kmem_stats_dump()
+{
+    i64 bytes[KMEM_NR_RANGES] = {0}, pages[NR_PAGE_TAGS] = {0};
+    printk("kmem stats:\n");
+    for (int cid = 0; cid < 4; cid++) {
+        auto st = &kmem_stat[cid];
+        printk("  CPU %d: %llu allocs, %llu frees\n", cid, st->nr_alloc, st->nr_free);
+        for (int i = 0; i < KMEM_NR_RANGES; i++)
+            bytes[i] += st->bytes[i];
+        for (int i = 0; i < NR_PAGE_TAGS; i++)
+            pages[i] += st->pages[i];
+    }
+    printk("  bytes in use:");
+    for (int i = 0; i < KMEM_NR_RANGES; i++)
+        printk(" %s %lld", kmem_range_name[i], bytes[i]);
+    printk("\n  pages in use:");
+    for (int i = 0; i < NR_PAGE_TAGS; i++)
+        printk(" %s %lld", page_tag_name[i], pages[i]);
+    printk("\n");
+    for (int i = 0; i < nr_kmem_caches; i++) {
+        auto c = &kmem_caches[i];
+        i64 slabs = 0;
+        for (int cid = 0; cid < 4; cid++)
+            slabs += c->nr_slabs[cid];
+        if (slabs)
+            printk("  cache %s(%u): %lld objects in use, %lld slabs\n", c->name, c->size,
+                   kmem_cache_inuse(c), slabs);
+    }
+    #ifdef KMEM_TRACK_CALLERS
+    track_dump();
     #endif
 }
+
+define_syscall(kmem_stats)
+{
+    kmem_stats_dump();
+    return 0;
+}
@@ -3,8 +3,103 @@
 #include <common/defines.h>
 #include <aarch64/mmu.h>
 
+// Buddy allocator: blocks of 2^order contiguous pages, order < MAX_ORDER.
+#define MAX_ORDER 11
+
+// Physical memory is split into one buddy zone per cpu.
+#define NZONES 4
+
+struct zone_stat
+{
+    u64 nr_pages;  // pages in the zone
+    u64 nr_free;   // pages free in the zone's buddy lists
+    u64 nr_alloc;  // pages handed out from the zone
+    u64 nr_stolen; // of which taken by other cpus after their zone ran dry
+};
+// Kept next to alloc_page_cnt; updated under the zone lock.
+extern struct zone_stat zone_stat[NZONES];
+
+// Per-CPU page cache watermarks (in pages).
+// An empty cache refills PAGE_CACHE_LOW pages from the buddy allocator; a cache
+// holding more than PAGE_CACHE_HIGH pages drains back down to PAGE_CACHE_LOW.
+#define PAGE_CACHE_SIZE 64
+#define PAGE_CACHE_HIGH 48
+#define PAGE_CACHE_LOW 16
+
+// Pre-zeroed pages kept per cpu, and how many the idle loop clears per pass.
+#define ZERO_POOL_SIZE 32
+#define ZERO_POOL_BATCH 4
+
+extern bool page_cache_enabled;
+// Return all pages cached on this cpu to the buddy allocator.
+void page_cache_drain();
+
+// What a page is used for, for kmem_stats_dump().
+enum page_tag {
+    PAGE_TAG_OTHER,
+    PAGE_TAG_PGTABLE,
+    PAGE_TAG_KSTACK,
+    PAGE_TAG_IPC,
+    PAGE_TAG_SLAB,
+    PAGE_TAG_LARGE,
+    NR_PAGE_TAGS,
+};
+
 WARN_RESULT void* kalloc_page();
+// Like kalloc_page(), but the page content is unspecified.
+// Use it when the caller overwrites the page immediately.
+WARN_RESULT void* kalloc_page_nozero();
+// kalloc_page() and kalloc_page_nozero() count the page as PAGE_TAG_OTHER.
+WARN_RESULT void* kalloc_page_tagged(enum page_tag);
+WARN_RESULT void* kalloc_page_nozero_tagged(enum page_tag);
 void kfree_page(void*);
+// Top up this cpu's pool of pre-zeroed pages. Called from the idle loop.
+void fill_zeroed_pages();
+// Print the per-cpu hit rate of the pre-zeroed pool.
+void page_zero_report();
+// Allocate 2^order physically contiguous pages, aligned to their size.
+// Returns NULL if no block that large is free.
+WARN_RESULT void* kalloc_pages(int order);
+void kfree_pages(void*, int order);
+// Copy the number of free blocks of each order into `nr_free`.
+void buddy_stat(u64 nr_free[MAX_ORDER]);
+
+// Slab objects live in one-page slabs behind a 16-byte header.
+#define SLAB_HEADER_SIZE 16
+#define SLAB_MAX_SIZE (PAGE_SIZE - SLAB_HEADER_SIZE)
+
+#define KMEM_MAX_CACHES 64
+// Free objects kept per cpu for each cache, and the refill/flush batch.
+#define KMEM_CPU_CACHE_SIZE 32
+#define KMEM_CPU_CACHE_BATCH 16
+// Completely free slabs kept per cpu for each cache before returning them to
+// the page allocator, and how many are kept after returning.
+#define SLAB_EMPTY_HIGH 4
+#define SLAB_EMPTY_LOW 1
+
+struct kmem_cache;
+extern bool kmem_cpu_cache_enabled;
+
+// Create a cache of `size`-byte objects. `ctor`, if given, runs once on
+// each object when its slab is created; objects must be in the constructed
+// state again when they are freed. Caches are never destroyed.
+WARN_RESULT struct kmem_cache* kmem_cache_create(const char* name, u32 size, void (*ctor)(void*));
+WARN_RESULT void* kmem_cache_alloc(struct kmem_cache*);
+void kmem_cache_free(struct kmem_cache*, void*);
+
+// Return the objects cached on this cpu to their slabs.
+void kmem_drain();
+// Print used bytes, free bytes and the largest free block in the slabs
+// owned by each cpu, and the used bytes held in per-cpu caches in total.
+void kmem_report();
+// Print allocation counts, bytes in use by size range, pages in use by
+// tag and objects in use per cache. Also available as SYS_kmem_stats.
+void kmem_stats_dump();
+// Objects of `c` allocated and not yet freed, over all cpus.
+i64 kmem_cache_inuse(struct kmem_cache*);
 
+// Sizes above SLAB_MAX_SIZE are backed by 2^k contiguous zeroed pages,
+// up to order MAX_ORDER - 1. Returns NULL when no such block is free.
 WARN_RESULT void* kalloc(isize);
+// Frees objects from kalloc() or any kmem_cache.
 void kfree(void*);
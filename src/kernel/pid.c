@@ -5,8 +5,10 @@
 int global_pid;
 ListNode global_pid_head;
 SpinLock pid_lock;
+static struct kmem_cache* pid_cache;
 
 define_early_init(init_global_pid) {
+    pid_cache = kmem_cache_create("pid_s", sizeof(pid_s), NULL);
     global_pid = 1;
     init_spinlock(&pid_lock);
     init_list_node(&global_pid_head);
@@ -17,7 +19,8 @@ void pid_grow(struct container* container) {
     ListNode* head = global ? &global_pid_head : &container->pid_head;
     for (int i = 0; i < 10; i++)
     {
-        auto p = (pid_s*) kalloc(sizeof(pid_s));
+        auto p = (pid_s*) kmem_cache_alloc(pid_cache);
+        p->used = 0;
         p->pid = global ? global_pid++ : container->max_pid++;
         init_list_node(&p->node);
         _insert_into_list(head, &p->node);
@@ -74,7 +77,7 @@ void pid_compact(struct container* container) {
         auto p = container_of(cur, pid_s, node);
         if (p->used == 0) {
             cur = _detach_from_list(cur)->next;
-            kfree(p);
+            kmem_cache_free(pid_cache, p);
         }
         else cur = cur->next;
     }
@@ -3,6 +3,7 @@
 #include <kernel/mem.h>
 #include <kernel/sched.h>
 #include <kernel/pid.h>
+#include <kernel/syscall.h>
 #include <common/list.h>
 #include <common/string.h>
 #include <common/spinlock.h>
@@ -11,6 +12,11 @@
 extern struct container root_container;
 
 struct proc root_proc;
+static struct kmem_cache* proc_cache;
+
+define_early_init(proc_cache) {
+    proc_cache = kmem_cache_create("proc", sizeof(struct proc), NULL);
+}
 
 // #define DEBUG_LOG_PROCLOCKINFO
 // #define DEBUG_LOG_EXITINFO
@@ -117,9 +123,10 @@ int wait(int* exitcode, int* pid)
                 pid_release(child->container, child->localpid);
                 kfree_page(child->kstack);
                 p = _detach_from_list(&child->ptnode);
-                kfree(child);
+                auto container = child->container;
+                kmem_cache_free(proc_cache, child);
                 _release_proc_lock();
-                pid_release(child->container, pid);
+                pid_release(container, pid);
                 return pid;
             }
         }
@@ -153,6 +160,16 @@ static struct proc* dfs_proctree(ListNode* p) {
     return NULL;
 }
 
+// Find the live proc with `pid`, or NULL. Must hold the proc lock.
+static struct proc* find_proc(int pid)
+{
+    found = false;
+    fail = false;
+    target_id = pid;
+    struct proc* p = dfs_proctree(&root_proc.ptnode);
+    return found ? p : NULL;
+}
+
 int kill(int pid)
 {
     // Set the killed flag of the proc to true and return 0.
@@ -160,12 +177,8 @@ int kill(int pid)
 
     bool kill = false; // Avoid access to global found after releasing proc_lock
     _acquire_proc_lock();
-    found = false;
-    fail = false;
-    target_id = pid;
-    struct proc* p = dfs_proctree(&root_proc.ptnode);
-    if (found) {
-        ASSERT(p);
+    struct proc* p = find_proc(pid);
+    if (p) {
         p->killed = 1;
         kill = true;
     }
@@ -177,6 +190,20 @@ int kill(int pid)
     else return -1;
 }
 
+// Set the affinity mask of proc `pid`, or of the caller if `pid` is 0
+define_syscall(sched_setaffinity, int pid, u64 mask)
+{
+    if (pid == 0)
+        return set_affinity(thisproc(), mask);
+    // Keep the proc lock, so that p cannot exit and be freed by its parent
+    // meanwhile. exit() takes the sched lock under it too.
+    _acquire_proc_lock();
+    struct proc* p = find_proc(pid);
+    int r = p ? set_affinity(p, mask) : -1;
+    _release_proc_lock();
+    return r;
+}
+
 int start_proc(struct proc* p, void(*entry)(u64), u64 arg)
 {
     // 1. set the parent to root_proc if NULL
@@ -217,7 +244,7 @@ void init_proc(struct proc* p)
     init_list_node(&p->children);
     init_list_node(&p->ptnode);
     init_schinfo(&p->schinfo, false);
-    p->kstack = kalloc_page();
+    p->kstack = kalloc_page_tagged(PAGE_TAG_KSTACK);
     ASSERT(p->kstack);
     p->ucontext = (UserContext*) ((u64) p->kstack + PAGE_SIZE - 16 - sizeof(UserContext));
     p->kcontext = (KernelContext*) ((u64) p->ucontext - sizeof(KernelContext));
@@ -225,7 +252,7 @@ void init_proc(struct proc* p)
 
 struct proc* create_proc()
 {
-    struct proc* p = kalloc(sizeof(struct proc));
+    struct proc* p = kmem_cache_alloc(proc_cache);
     init_proc(p);
     return p;
 }
@@ -3,6 +3,10 @@
 #include <kernel/printk.h>
 #include <common/string.h>
 #include <aarch64/intrinsic.h>
+#include <common/bitmap.h>
+#include <common/spinlock.h>
+#include <kernel/cpu.h>
+#include <kernel/init.h>
 
 // #define DEBUG_LOG_VA_PART
 // #define DEBUG_LOG_FREEPAGECOUNT
@@ -27,10 +31,10 @@ PTEntriesPtr get_pte(struct pgdir* pgdir, u64 va, bool alloc)
     pt0 = pgdir->pt;
     if (pt0 == NULL) {
         if (!alloc) return NULL;
-        pt0 = kalloc_page();
-        pt1 = kalloc_page();
-        pt2 = kalloc_page();
-        pt3 = kalloc_page();
+        pt0 = kalloc_page_tagged(PAGE_TAG_PGTABLE);
+        pt1 = kalloc_page_tagged(PAGE_TAG_PGTABLE);
+        pt2 = kalloc_page_tagged(PAGE_TAG_PGTABLE);
+        pt3 = kalloc_page_tagged(PAGE_TAG_PGTABLE);
         ASSERT(pt0 && pt1 && pt2 && pt3);
         pgdir->pt = pt0;
         pt0[VA_PART0(va)] = K2P(pt1) | PTE_TABLE;
@@ -46,9 +50,9 @@ PTEntriesPtr get_pte(struct pgdir* pgdir, u64 va, bool alloc)
     pt1 = (PTEntriesPtr) P2K(PTE_ADDRESS(pt0[VA_PART0(va)]));
     if (K2P(pt1) == NULL) {
         if (!alloc) return NULL;
-        pt1 = kalloc_page();
-        pt2 = kalloc_page();
-        pt3 = kalloc_page();
+        pt1 = kalloc_page_tagged(PAGE_TAG_PGTABLE);
+        pt2 = kalloc_page_tagged(PAGE_TAG_PGTABLE);
+        pt3 = kalloc_page_tagged(PAGE_TAG_PGTABLE);
         ASSERT(pt1 && pt2 && pt3);
         pt0[VA_PART0(va)] = K2P(pt1) | PTE_TABLE;
         pt1[VA_PART1(va)] = K2P(pt2) | PTE_TABLE;
@@ -63,8 +67,8 @@ PTEntriesPtr get_pte(struct pgdir* pgdir, u64 va, bool alloc)
     pt2 = (PTEntriesPtr) P2K(PTE_ADDRESS(pt1[VA_PART1(va)]));
     if (K2P(pt2) == NULL) {
         if (!alloc) return NULL;
-        pt2 = kalloc_page();
-        pt3 = kalloc_page();
+        pt2 = kalloc_page_tagged(PAGE_TAG_PGTABLE);
+        pt3 = kalloc_page_tagged(PAGE_TAG_PGTABLE);
         ASSERT(pt2 && pt3);
         pt1[VA_PART1(va)] = K2P(pt2) | PTE_TABLE;
         pt2[VA_PART2(va)] = K2P(pt3) | PTE_TABLE;
@@ -78,7 +82,7 @@ PTEntriesPtr get_pte(struct pgdir* pgdir, u64 va, bool alloc)
     pt3 = (PTEntriesPtr) P2K(PTE_ADDRESS(pt2[VA_PART2(va)]));
     if (K2P(pt3) == NULL) {
         if (!alloc) return NULL;
-        pt3 = kalloc_page();
+        pt3 = kalloc_page_tagged(PAGE_TAG_PGTABLE);
         ASSERT(pt3);
         pt2[VA_PART2(va)] = K2P(pt3) | PTE_TABLE;
 
@@ -92,6 +96,102 @@ PTEntriesPtr get_pte(struct pgdir* pgdir, u64 va, bool alloc)
 void init_pgdir(struct pgdir* pgdir)
 {
     pgdir->pt = NULL;
+    pgdir->asid = 0;
+}
+
+// Address space IDs. User mappings are not global, so their TLB entries
+// are tagged with the ASID in TTBR0 and switching pgdirs needs no flush.
+// ASIDs are handed out once per generation from asid_map. When it runs
+// out, a new generation starts, and every cpu flushes its TLB before it
+// next takes an ASID. ASID 0 goes with invalid_pt.
+#define ASID_BITS 8
+#define NR_ASIDS (1 << ASID_BITS)
+#define ASID_MASK ((u64) NR_ASIDS - 1)
+
+static SpinLock asid_lock;
+static u64 asid_generation = NR_ASIDS;
+static Bitmap(asid_map, NR_ASIDS);
+static u64 asid_next = 1;
+// The ASID each cpu switched to last, or 0 if it has not switched since
+// the last rollover; and the one it keeps across a rollover
+static u64 active_asid[NCPU], reserved_asid[NCPU];
+static bool tlb_flush_pending[NCPU];
+// What each cpu has in TTBR0
+static u64 cur_ttbr0[NCPU];
+
+define_early_init(asid)
+{
+    init_spinlock(&asid_lock);
+    memset(asid_map, 0, sizeof(asid_map));
+    bitmap_set(asid_map, 0);
+}
+
+// Start a new generation. The ASID each cpu is running stays taken, so
+// its TTBR0 remains valid. Must hold asid_lock.
+static void asid_rollover()
+{
+    asid_generation += NR_ASIDS;
+    memset(asid_map, 0, sizeof(asid_map));
+    bitmap_set(asid_map, 0);
+    for (int i = 0; i < NCPU; i++) {
+        u64 asid = __atomic_exchange_n(&active_asid[i], 0, __ATOMIC_RELAXED);
+        if (asid == 0)
+            asid = reserved_asid[i];
+        bitmap_set(asid_map, asid & ASID_MASK);
+        reserved_asid[i] = asid;
+        tlb_flush_pending[i] = true;
+    }
+    asid_next = 1;
+}
+
+// Move reservations of `asid` to `newasid`. Returns whether there were any.
+static bool asid_reserved(u64 asid, u64 newasid)
+{
+    bool hit = false;
+    for (int i = 0; i < NCPU; i++) {
+        if (reserved_asid[i] == asid) {
+            reserved_asid[i] = newasid;
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+// An ASID of the current generation for `pgdir`, keeping its old number
+// if possible. Must hold asid_lock.
+static u64 new_asid(struct pgdir* pgdir)
+{
+    u64 asid = pgdir->asid;
+    if (asid) {
+        u64 newasid = asid_generation | (asid & ASID_MASK);
+        if (asid_reserved(asid, newasid))
+            return newasid;
+        if (!bitmap_get(asid_map, asid & ASID_MASK)) {
+            bitmap_set(asid_map, asid & ASID_MASK);
+            return newasid;
+        }
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        for (u64 i = asid_next; i < NR_ASIDS; i++) {
+            if (!bitmap_get(asid_map, i)) {
+                bitmap_set(asid_map, i);
+                asid_next = i + 1;
+                return asid_generation | i;
+            }
+        }
+        asid_rollover();
+    }
+    PANIC();
+}
+
+static void set_ttbr0(u64 pt, u64 asid)
+{
+    int cid = cpuid();
+    u64 ttbr0 = pt | ((asid & ASID_MASK) << 48);
+    if (cur_ttbr0[cid] != ttbr0) {
+        cur_ttbr0[cid] = ttbr0;
+        arch_set_ttbr0_asid(pt, asid & ASID_MASK);
+    }
 }
 
 void free_pgdir(struct pgdir* pgdir)
@@ -100,6 +200,12 @@ void free_pgdir(struct pgdir* pgdir)
     // Free pages used by the page table. If pgdir->pt=NULL, do nothing.
     // DONT FREE PAGES DESCRIBED BY THE PAGE TABLE
     if (pgdir->pt == NULL) return;
+    // Stop using it here, and drop its TLB entries everywhere
+    extern PTEntries invalid_pt;
+    if (PTE_ADDRESS(cur_ttbr0[cpuid()]) == K2P(pgdir->pt))
+        set_ttbr0(K2P(&invalid_pt), 0);
+    if (pgdir->asid)
+        arch_tlbi_aside1is(pgdir->asid & ASID_MASK);
     int f0 = 0, f1 = 0, f2 = 0, f3 = 0;
     for (int i0 = 0; i0 < N_PTE_PER_TABLE; i0++) {
         PTEntriesPtr pt1 = (PTEntriesPtr) P2K(PTE_ADDRESS(pgdir->pt[i0]));
@@ -121,19 +227,43 @@ void free_pgdir(struct pgdir* pgdir)
     }
     kfree_page((void*)pgdir->pt);
     f0++;
+    pgdir->pt = NULL;
+    pgdir->asid = 0;
 
     #ifdef DEBUG_LOG_FREEPAGECOUNT
     printk("Free count:\nL0: %d\tL1: %d\tL2: %d\tL3: %d\n", f0, f1, f2, f3);
     #endif
 }
 
+// Load `pgdir` into TTBR0, unless it is there already. Nothing is mapped in
+// invalid_pt, so procs without a pgdir share it and never need a write.
 void attach_pgdir(struct pgdir* pgdir)
 {
     extern PTEntries invalid_pt;
-    if (pgdir->pt)
-        arch_set_ttbr0(K2P(pgdir->pt));
-    else
-        arch_set_ttbr0(K2P(&invalid_pt));
+    if (pgdir->pt == NULL) {
+        set_ttbr0(K2P(&invalid_pt), 0);
+        return;
+    }
+    int cid = cpuid();
+    u64 asid = pgdir->asid;
+    u64 old = __atomic_load_n(&active_asid[cid], __ATOMIC_RELAXED);
+    // Without the lock if the ASID is current and no rollover has cleared
+    // active_asid since this cpu last switched
+    if (!(old && (asid & ~ASID_MASK) == __atomic_load_n(&asid_generation, __ATOMIC_RELAXED)
+          && __atomic_compare_exchange_n(&active_asid[cid], &old, asid, false,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))) {
+        _acquire_spinlock(&asid_lock);
+        if ((pgdir->asid & ~ASID_MASK) != asid_generation)
+            pgdir->asid = new_asid(pgdir);
+        asid = pgdir->asid;
+        if (tlb_flush_pending[cid]) {
+            tlb_flush_pending[cid] = false;
+            arch_tlbi_vmalle1();
+        }
+        active_asid[cid] = asid;
+        _release_spinlock(&asid_lock);
+    }
+    set_ttbr0(K2P(pgdir->pt), asid);
 }
 
 
@@ -5,6 +5,8 @@
 struct pgdir
 {
     PTEntriesPtr pt;
+    // ASID, with its generation in the bits above ASID_BITS; 0 if none
+    u64 asid;
 };
 
 void init_pgdir(struct pgdir* pgdir);
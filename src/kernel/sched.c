@@ -6,6 +6,8 @@
 #include <aarch64/intrinsic.h>
 #include <kernel/cpu.h>
 #include <driver/clock.h>
+#include <driver/interrupt.h>
+#include <kernel/syscall.h>
 #include <common/rbtree.h>
 #include <common/string.h>
 
@@ -19,15 +21,48 @@ extern struct timer sched_timer[4];
 
 extern void swtch(KernelContext* new_ctx, KernelContext** old_ctx);
 
-SpinLock sched_lock;
+// Each cpu has its own CFS run queue: its schqueue in every container,
+// guarded by cpus[i].sched.lock. A container is represented on every cpu
+// by its own group entity in its parent's queue for that cpu. A proc sits
+// on the queue of schinfo.cpu, and only moves to another cpu when that cpu
+// steals it under the victim's lock.
+//
+// Procs of the real-time class (SCHED_FIFO/SCHED_RR) bypass containers and
+// sit on the cpu's rt_rq instead, which pick_next looks at first.
+//
+// _acquire_sched_lock() locks this cpu's run queue. As before, it is held
+// across the context switch and released by the proc switched to.
+
+// Interval (ms) between periodic load balancing on each cpu
+#define BALANCE_INTERVAL 100
+
 define_early_init(init_sched_lock) {
-    init_spinlock(&sched_lock);
+    for (int i = 0; i < NCPU; i++) {
+        init_spinlock(&cpus[i].sched.lock);
+        cpus[i].sched.nr_running = 0;
+        init_list_node(&cpus[i].sched.throttled);
+        auto rt = &cpus[i].sched.rt;
+        memset(rt->bitmap, 0, sizeof(rt->bitmap));
+        for (int j = 0; j < RT_NR_PRIO; j++)
+            init_list_node(&rt->queue[j]);
+    }
+}
+
+static int latency_bucket(u64 cycles)
+{
+    u64 us = cycles / (get_clock_frequency() / 1000000);
+    int i = 0;
+    for (u64 limit = 10; i < SCHED_NR_BUCKETS - 1 && us >= limit; limit *= 10)
+        i++;
+    return i;
 }
 
 void _acquire_sched_lock()
 {
     // acquire the sched_lock if need
-    _acquire_spinlock(&sched_lock);
+    auto s = &cpus[cpuid()].sched;
+    _acquire_spinlock(&s->lock);
+    s->lock_start = get_timestamp();
 
     #ifdef DEBUG_LOG_SCHEDLOCKINFO
     printk("+CPU %d Acquired sched lock\n", cpuid());
@@ -37,13 +72,30 @@ void _acquire_sched_lock()
 void _release_sched_lock()
 {
     // release the sched_lock if need
-    _release_spinlock(&sched_lock);
+    auto s = &cpus[cpuid()].sched;
+    u64 held = get_timestamp() - s->lock_start;
+    s->lock_cycles += held;
+    s->stat.lock_hist[latency_bucket(held)]++;
+    _release_spinlock(&s->lock);
 
     #ifdef DEBUG_LOG_SCHEDLOCKINFO
     printk("-CPU %d Released sched lock\n", cpuid());
     #endif
 }
 
+// Lock the run queue `p` is on. Retry if p moves while we wait.
+static struct sched* lock_proc_rq(struct proc* p)
+{
+    while (1) {
+        int cpu = p->schinfo.cpu;
+        auto s = &cpus[cpu].sched;
+        _acquire_spinlock(&s->lock);
+        if (p->schinfo.cpu == cpu)
+            return s;
+        _release_spinlock(&s->lock);
+    }
+}
+
 
 // CFS Scheduler
 void _acquire_schedtree_lock() {
@@ -60,6 +112,7 @@ define_init(idle_init) {
         ASSERT(p);
         p->idle = true;
         p->state = RUNNING;
+        p->schinfo.cpu = i;
         cpus[i].sched.idle = p;
         cpus[i].sched.thisproc = p;
         // idle may need its schinfo, if a sheduler uses idle
@@ -78,6 +131,8 @@ bool _schedtree_node_cmp(rb_node lnode, rb_node rnode) {
 
 void init_schqueue(struct schqueue* sq) {
     memset(&sq->sched_root.rb_node, 0, sizeof(struct rb_root_));
+    sq->nr_queued = 0;
+    sq->min_vruntime = 0;
 }
 
 struct proc* thisproc()
@@ -88,151 +143,1079 @@ struct proc* thisproc()
 
 void init_schinfo(struct schinfo* p, bool group) {
     p->vruntime = 0;
+    p->weight = NICE_0_WEIGHT;
     p->lastrun = 0;
     p->is_container = group;
+    p->policy = SCHED_NORMAL;
+    p->rt_prio = 0;
+    init_list_node(&p->rt_node);
+    p->cpus_allowed = CPUMASK_ALL;
+    p->cpu = 0;
 }
 
 bool is_zombie(struct proc* p)
 {
     bool r;
-    _acquire_sched_lock();
+    auto s = lock_proc_rq(p);
     r = p->state == ZOMBIE;
-    _release_sched_lock();
+    _release_spinlock(&s->lock);
     return r;
 }
 
 bool is_unused(struct proc* p)
 {
     bool r;
-    _acquire_sched_lock();
+    auto s = lock_proc_rq(p);
     r = p->state == UNUSED;
-    _release_sched_lock();
+    _release_spinlock(&s->lock);
     return r;
 }
 
+static u64 ms_to_cycles(u64 ms)
+{
+    return ms * (get_clock_frequency() / 1000);
+}
+
+// Advance sq->min_vruntime to the smallest vruntime of its queued
+// entities and of `curr`, the one that just ran, but never back.
+static void update_min_vruntime(struct schqueue* sq, u64 curr)
+{
+    u64 vr = curr;
+    rb_node node = _rb_first(&sq->sched_root);
+    if (node)
+        vr = MIN(vr, container_of(node, struct schinfo, rbnode)->vruntime);
+    sq->min_vruntime = MAX(sq->min_vruntime, vr);
+}
+
+// Place `se`, back from sleep, in `sq`. It keeps the vruntime it had, so a
+// short nap costs it nothing, but no less than half a latency period below
+// min_vruntime: a long sleeper gets a head start, but cannot hoard credit.
+static void place_entity(struct schqueue* sq, struct schinfo* se)
+{
+    u64 credit = ms_to_cycles(sched_latency_ms) / 2;
+    u64 floor = sq->min_vruntime > credit ? sq->min_vruntime - credit : 0;
+    se->vruntime = MAX(se->vruntime, floor);
+}
+
+// Carry the lead or lag of `se` over min_vruntime from queue `from` to `to`
+// when it changes cpu, as vruntimes of different cpus are not comparable.
+static void migrate_vruntime(struct schinfo* se, struct schqueue* from, struct schqueue* to)
+{
+    if (se->vruntime >= from->min_vruntime)
+        se->vruntime = to->min_vruntime + (se->vruntime - from->min_vruntime);
+    else
+        se->vruntime = to->min_vruntime - MIN(to->min_vruntime, from->min_vruntime - se->vruntime);
+}
+
+// Per-entity load tracking. Every 1 ms period an entity spends runnable
+// (running) adds PELT_SCALE to its load (util) sum, and all sums decay by
+// y per period, with y^32 = 1/2. The sums are brought up to date whenever
+// the entity's state is about to change.
+
+// PELT_SCALE / (1 - y): the sum of an entity that has always been runnable
+#define PELT_SUM_MAX 47742
+
+// y^n * 2^32, for n in [0, 32)
+static const u32 pelt_decay_inv[32] = {
+    0xffffffff, 0xfa83b2da, 0xf5257d14, 0xefe4b99a, 0xeac0c6e6, 0xe5b906e6,
+    0xe0ccdeeb, 0xdbfbb796, 0xd744fcc9, 0xd2a81d91, 0xce248c14, 0xc9b9bd85,
+    0xc5672a10, 0xc12c4cc9, 0xbd08a39e, 0xb8fbaf46, 0xb504f333, 0xb123f581,
+    0xad583ee9, 0xa9a15ab4, 0xa5fed6a9, 0xa2704302, 0x9ef5325f, 0x9b8d39b9,
+    0x9837f050, 0x94f4efa8, 0x91c3d373, 0x8ea4398a, 0x8b95c1e3, 0x88980e80,
+    0x85aac367, 0x82cd8698,
+};
+
+// `val` decayed over `n` periods
+static u64 pelt_decay(u64 val, u64 n)
+{
+    if (n >= 64 * 32)
+        return 0;
+    val >>= n / 32;
+    return (val * pelt_decay_inv[n % 32]) >> 32;
+}
+
+// Bring `sa` up to `now`, the entity having been runnable and running as
+// given since the last update. Time short of a whole period is left for
+// the next update.
+static void pelt_update(struct sched_avg* sa, u64 now, bool runnable, bool running, u32 weight)
+{
+    if (sa->last_update == 0) {
+        sa->last_update = now;
+        return;
+    }
+    u64 period = ms_to_cycles(1);
+    u64 n = now > sa->last_update ? (now - sa->last_update) / period : 0;
+    if (n == 0)
+        return;
+    sa->last_update += n * period;
+    u64 contrib = PELT_SUM_MAX - pelt_decay(PELT_SUM_MAX, n);
+    sa->load_sum = pelt_decay(sa->load_sum, n) + (runnable ? contrib : 0);
+    sa->util_sum = pelt_decay(sa->util_sum, n) + (running ? contrib : 0);
+    sa->load_avg = weight * sa->load_sum / PELT_SUM_MAX;
+    sa->util_avg = PELT_SCALE * sa->util_sum / PELT_SUM_MAX;
+}
+
+// Whether the proc running on `cpu` belongs to `c` or a descendant
+static bool runs_in(struct container* c, int cpu)
+{
+    auto p = cpus[cpu].sched.thisproc;
+    if (p->idle || p->schinfo.policy != SCHED_NORMAL)
+        return false;
+    for (auto x = p->container; x; x = x->parent)
+        if (x == c)
+            return true;
+    return false;
+}
+
+static void pelt_update_group(struct container* c, int cpu, u64 now)
+{
+    bool running = runs_in(c, cpu);
+    bool runnable = running || c->schqueue[cpu].nr_queued > 0;
+    pelt_update(&c->schinfo[cpu].avg, now, runnable, running, c->schinfo[cpu].weight);
+}
+
+static void pelt_update_cpu(int cpu, u64 now)
+{
+    auto s = &cpus[cpu].sched;
+    bool running = !s->thisproc->idle;
+    pelt_update(&s->avg, now, running || s->nr_running > 0, running, NICE_0_WEIGHT);
+}
+
+// `avg`, decayed to now for an entity that has been idle since `last_update`
+static u64 pelt_decayed(u64 avg, u64 last_update)
+{
+    u64 now = get_timestamp();
+    if (last_update == 0 || now <= last_update)
+        return avg;
+    return pelt_decay(avg, (now - last_update) / ms_to_cycles(1));
+}
+
+// The averages are read without the run queue locks. Those of an idle cpu
+// or container have not been updated since it went idle.
+u64 cpu_load_avg(int cpu)
+{
+    auto s = &cpus[cpu].sched;
+    if (s->thisproc->idle && s->nr_running == 0)
+        return pelt_decayed(s->avg.load_avg, s->avg.last_update);
+    return s->avg.load_avg;
+}
+
+u64 cpu_util_avg(int cpu)
+{
+    auto s = &cpus[cpu].sched;
+    if (s->thisproc->idle && s->nr_running == 0)
+        return pelt_decayed(s->avg.util_avg, s->avg.last_update);
+    return s->avg.util_avg;
+}
+
+static bool group_idle(struct container* c, int cpu)
+{
+    return c->schqueue[cpu].nr_queued == 0 && !runs_in(c, cpu);
+}
+
+u64 container_load_avg(struct container* c)
+{
+    u64 sum = 0;
+    for (int i = 0; i < NCPU; i++) {
+        auto sa = &c->schinfo[i].avg;
+        sum += group_idle(c, i) ? pelt_decayed(sa->load_avg, sa->last_update) : sa->load_avg;
+    }
+    return sum;
+}
+
+u64 container_util_avg(struct container* c)
+{
+    u64 sum = 0;
+    for (int i = 0; i < NCPU; i++) {
+        auto sa = &c->schinfo[i].avg;
+        sum += group_idle(c, i) ? pelt_decayed(sa->util_avg, sa->last_update) : sa->util_avg;
+    }
+    return sum;
+}
+
+// Insert `se` into the queue of container `c` on `cpu`. If that queue was
+// empty, the group entity of `c` is queued in its parent in turn, keeping
+// the vruntime it has been charged but no less than the parent's minimum.
+// A throttled container stays out of its parent's queue.
+static void enqueue_entity(struct container* c, struct schinfo* se, int cpu)
+{
+    u64 now = get_timestamp();
+    while (1) {
+        auto sq = &c->schqueue[cpu];
+        pelt_update_group(c, cpu, now);
+        ASSERT(_rb_insert(&se->rbnode, &sq->sched_root, _schedtree_node_cmp) == 0);
+        if (sq->nr_queued++ > 0 || c == &root_container || c->throttled[cpu])
+            break;
+        se = &c->schinfo[cpu];
+        c = c->parent;
+        place_entity(&c->schqueue[cpu], se);
+    }
+}
+
+// Remove `se` from the queue of `c` on `cpu`, and dequeue every group
+// entity left with an empty queue on the way up.
+static void dequeue_entity(struct container* c, struct schinfo* se, int cpu)
+{
+    u64 now = get_timestamp();
+    while (1) {
+        auto sq = &c->schqueue[cpu];
+        pelt_update_group(c, cpu, now);
+        _rb_erase(&se->rbnode, &sq->sched_root);
+        if (--sq->nr_queued > 0 || c == &root_container || c->throttled[cpu])
+            break;
+        se = &c->schinfo[cpu];
+        c = c->parent;
+    }
+}
+
+static int rt_top_prio(struct rt_rq* rt)
+{
+    return 63 - __builtin_clzll(rt->bitmap[0]);
+}
+
+static void rt_enqueue(struct rt_rq* rt, struct schinfo* se, bool head)
+{
+    auto q = &rt->queue[se->rt_prio];
+    _insert_into_list(head ? q : q->prev, &se->rt_node);
+    bitmap_set(rt->bitmap, se->rt_prio);
+    rt->nr_running++;
+}
+
+static void rt_dequeue(struct rt_rq* rt, struct schinfo* se)
+{
+    _detach_from_list(&se->rt_node);
+    if (_empty_list(&rt->queue[se->rt_prio]))
+        bitmap_clear(rt->bitmap, se->rt_prio);
+    rt->nr_running--;
+}
+
+// Queue `p` on the run queue of `cpu`, whose lock must be held.
+static void enqueue_proc(struct proc* p, int cpu)
+{
+    pelt_update_cpu(cpu, get_timestamp());
+    if (p->schinfo.policy != SCHED_NORMAL)
+        rt_enqueue(&cpus[cpu].sched.rt, &p->schinfo, false);
+    else
+        enqueue_entity(p->container, &p->schinfo, cpu);
+    cpus[cpu].sched.nr_running++;
+}
+
+static void dequeue_proc(struct proc* p, int cpu)
+{
+    if (p->schinfo.policy != SCHED_NORMAL)
+        rt_dequeue(&cpus[cpu].sched.rt, &p->schinfo);
+    else
+        dequeue_entity(p->container, &p->schinfo, cpu);
+    cpus[cpu].sched.nr_running--;
+}
+
+// Procs on a cpu's run queue, plus the one it is running
+static int cpu_load(int cpu)
+{
+    auto s = &cpus[cpu].sched;
+    return s->nr_running + !s->thisproc->idle;
+}
+
+// Cpus `p` may run on: its own mask, narrowed by those of its containers
+static u64 allowed_cpus(struct proc* p)
+{
+    u64 mask = p->schinfo.cpus_allowed;
+    for (auto c = p->container; c; c = c->parent)
+        mask &= c->cpus_allowed;
+    return mask ? mask : p->schinfo.cpus_allowed;
+}
+
+static bool cpu_allowed(struct proc* p, int cpu)
+{
+    return (allowed_cpus(p) >> cpu) & 1;
+}
+
+// The least loaded cpu in `mask`. Ties go to the one with less recent
+// utilization, then to this one.
+static int least_loaded_cpu(u64 mask)
+{
+    int best = -1;
+    if ((mask >> cpuid()) & 1)
+        best = cpuid();
+    for (int i = 0; i < NCPU; i++) {
+        if (!((mask >> i) & 1) || i == best)
+            continue;
+        if (best < 0 || cpu_load(i) < cpu_load(best)
+            || (cpu_load(i) == cpu_load(best) && cpu_util_avg(i) < cpu_util_avg(best)))
+            best = i;
+    }
+    return best;
+}
+
+u64 sched_latency_ms = 40;
+u64 sched_min_granularity_ms = 20;
+// Shortest slice whatever the knobs say. Timers count whole ms from the
+// current ms, so a 1 ms slice may end at once and the cpu does nothing but
+// schedule, and a 0 ms slice would stop the tick (see arm_sched_tick()).
+#define SCHED_MIN_SLICE_MS 2
+
+bool sched_tickless = true;
+// Tick of an idle cpu when wakeup IPIs are off. Nothing else would get it
+// to look at procs queued on it or to steal work.
+#define IDLE_BALANCE_MS 250
+// Tick of a cpu with a single runnable proc
+#define SINGLE_TICK_MS 200
+
+// Time slice for the proc about to run on a cpu with `nr_running` others
+// queued: every runnable proc should get a turn within sched_latency_ms,
+// but no turn is shorter than sched_min_granularity_ms.
+static u64 time_slice_ms(int nr_running)
+{
+    u64 min = MAX(sched_min_granularity_ms, (u64) SCHED_MIN_SLICE_MS);
+    return MAX(sched_latency_ms / (nr_running + 1), min);
+}
+
+static bool __my_timer_cmp(rb_node lnode, rb_node rnode) {
+    i64 d = container_of(lnode, struct timer, _node)->_key - container_of(rnode, struct timer, _node)->_key;
+    if (d < 0)
+        return true;
+    if (d == 0)
+        return lnode < rnode;
+    return false;
+}
+
+// (Re)arm this cpu's sched timer to fire in `ms`.
+static void arm_sched_tick(u64 ms)
+{
+    auto t = &sched_timer[cpuid()];
+    auto check = _rb_lookup(&t->_node, &(cpus[cpuid()].timer), __my_timer_cmp);
+    if (check)
+        cancel_cpu_timer(t);
+    cpus[cpuid()].sched.tick_extended = false;
+    if (ms) {
+        t->elapse = ms;
+        set_cpu_timer(t);
+    }
+}
+
+u64 sched_rt_period_ms = 1000;
+u64 sched_rt_runtime_ms = 950;
+
+// Start a new RT period, lifting the throttle, if the last one is over
+static void rt_update_period(struct rt_rq* rt)
+{
+    u64 now = get_timestamp();
+    if (now - rt->period_start >= ms_to_cycles(sched_rt_period_ms)) {
+        rt->period_start = now;
+        rt->runtime = 0;
+        rt->throttled = false;
+    }
+}
+
+static void rt_charge(struct rt_rq* rt, u64 run)
+{
+    rt->runtime += run;
+    if (rt->runtime >= ms_to_cycles(sched_rt_runtime_ms))
+        rt->throttled = true;
+}
+
+// Whether the best RT proc queued on `s` should run instead of thisproc
+static bool rt_should_preempt(struct sched* s)
+{
+    if (s->rt.nr_running == 0 || s->rt.throttled)
+        return false;
+    auto cur = s->thisproc;
+    return cur->idle || cur->schinfo.policy == SCHED_NORMAL
+           || rt_top_prio(&s->rt) > cur->schinfo.rt_prio;
+}
+
+bool sched_wakeup_ipi = true;
+
+// Interrupt `cpu` if it may not notice a proc just queued on it: it is
+// idle in wfi, or its tick has been stretched.
+static void kick_cpu(int cpu)
+{
+    auto s = &cpus[cpu].sched;
+    if (sched_wakeup_ipi && cpu != cpuid() && (s->thisproc->idle || s->tick_extended))
+        send_ipi(cpu);
+}
+
+// Get an idle cpu other than this one, if any, to look for work to steal
+static void kick_idle_cpu()
+{
+    for (int i = 0; i < NCPU; i++) {
+        if (i != cpuid() && cpus[i].sched.thisproc->idle) {
+            kick_cpu(i);
+            return;
+        }
+    }
+}
+
+static void sched_ipi_handler()
+{
+    auto s = &cpus[cpuid()].sched;
+    // An idle cpu looks for work right away, here or on other cpus. A proc
+    // that may no longer run here is switched out to be moved.
+    if (s->thisproc->idle || rt_should_preempt(s) || !cpu_allowed(s->thisproc, cpuid()))
+        preempt();
+    else if (s->tick_extended)
+        arm_sched_tick(time_slice_ms(s->nr_running));
+}
+
+define_early_init(sched_ipi) {
+    set_ipi_handler(sched_ipi_handler);
+}
+
+bool sched_wake_prev_cpu = true;
+u64 sched_migration_cost_ms = 2;
+// Most procs on the last cpu of a cache-hot proc for it to wake there
+#define WAKE_LIGHT_LOAD 1
+
+static bool cache_hot(struct proc* p)
+{
+    return p->schinfo.last_ran
+           && get_timestamp() - p->schinfo.last_ran < ms_to_cycles(sched_migration_cost_ms);
+}
+
+// The cpu to wake `p` on, given it last ran on `prev`. All cpus share the
+// L2 cache, so any idle cpu is as good a fallback as another.
+static int select_wake_cpu(struct proc* p, int prev)
+{
+    u64 mask = allowed_cpus(p);
+    int target = least_loaded_cpu(mask);
+    if (!sched_wake_prev_cpu || !((mask >> prev) & 1))
+        return target;
+    if (cpu_load(prev) == 0 || (cache_hot(p) && cpu_load(prev) <= WAKE_LIGHT_LOAD))
+        return prev;
+    return cpu_load(target) == 0 ? target : prev;
+}
+
 bool _activate_proc(struct proc* p, bool onalert)
 {
     // if the proc->state is RUNNING/RUNNABLE, do nothing
     // if the proc->state if SLEEPING/UNUSED, set the process state to RUNNABLE and add it to the sched queue
     // else(ZOMBIE): return false 
-    if (p->state == RUNNABLE || p->state == RUNNING) return false;
-    else if (p->state == SLEEPING || p->state == UNUSED || p->state == DEEPSLEEPING)
-    {   
-        if (p->state == DEEPSLEEPING && onalert == true) return false;
-        _acquire_sched_lock();
-        p->state = RUNNABLE;
-        struct rb_root_ *schedQ = &p->container->schqueue.sched_root;
-        rb_node minNode = _rb_first(schedQ);
-        u64 mintime;
-        if (minNode == NULL)
-            mintime = 0;
+    // A proc that has never run goes to the least loaded cpu it may use.
+    // A sleeper goes where select_wake_cpu() says.
+    if (p->state == UNUSED)
+        p->schinfo.cpu = least_loaded_cpu(allowed_cpus(p));
+    struct sched* s;
+    int cpu;
+    while (1) {
+        s = lock_proc_rq(p);
+        if (!(p->state == SLEEPING || p->state == UNUSED
+              || (p->state == DEEPSLEEPING && !onalert))) {
+            _release_spinlock(&s->lock);
+            return false;
+        }
+        cpu = p->schinfo.cpu;
+        bool allowed = cpu_allowed(p, cpu);
+        int target = select_wake_cpu(p, cpu);
+        if (target == cpu)
+            break;
+        // Hold both locks while moving, so p is never RUNNABLE without
+        // being queued under the lock it points to. Locks are taken in
+        // no fixed order, so the new one is only tried.
+        auto ts = &cpus[target].sched;
+        if (_try_acquire_spinlock(&ts->lock)) {
+            migrate_vruntime(&p->schinfo, &p->container->schqueue[cpu],
+                             &p->container->schqueue[target]);
+            p->schinfo.cpu = cpu = target;
+            _release_spinlock(&s->lock);
+            s = ts;
+            break;
+        }
+        if (allowed)
+            break;
+        // It must not stay here: let go of the lock and try again
+        _release_spinlock(&s->lock);
+    }
+    // A new proc starts level with the queue
+    auto sq = &p->container->schqueue[cpu];
+    if (p->state == UNUSED)
+        p->schinfo.vruntime = sq->min_vruntime;
+    else
+        place_entity(sq, &p->schinfo);
+    p->state = RUNNABLE;
+    p->schinfo.queued_at = get_timestamp();
+    // It has been asleep since the last update
+    pelt_update(&p->schinfo.avg, p->schinfo.queued_at, false, false, p->schinfo.weight);
+    enqueue_proc(p, cpu);
+    // thisproc has competition again: bring back the normal tick
+    if (cpu == cpuid() && s->tick_extended)
+        arm_sched_tick(time_slice_ms(s->nr_running));
+    // An RT proc must not wait for the tick, even on this cpu
+    bool rt_kick = p->schinfo.policy != SCHED_NORMAL && rt_should_preempt(s);
+    _release_spinlock(&s->lock);
+    if (rt_kick)
+        send_ipi(cpu);
+    else
+        kick_cpu(cpu);
+    return true;
+}
+
+// Weights of nice -20 .. 19, each about 1.25 times the next
+static const u32 nice_to_weight[40] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+     9548,  7620,  6100,  4904,  3906,
+     3121,  2501,  1991,  1586,  1277,
+     1024,   820,   655,   526,   423,
+      335,   272,   215,   172,   137,
+      110,    87,    70,    56,    45,
+       36,    29,    23,    18,    15,
+};
+
+void set_nice(struct proc* p, int nice)
+{
+    nice = MAX(-20, MIN(19, nice));
+    auto s = lock_proc_rq(p);
+    p->schinfo.weight = nice_to_weight[nice + 20];
+    _release_spinlock(&s->lock);
+}
+
+int set_sched_policy(struct proc* p, int policy, int rt_prio)
+{
+    if (policy == SCHED_NORMAL)
+        rt_prio = 0;
+    else if (policy != SCHED_FIFO && policy != SCHED_RR)
+        return -1;
+    if (rt_prio < 0 || rt_prio >= RT_NR_PRIO)
+        return -1;
+    auto s = lock_proc_rq(p);
+    int cpu = p->schinfo.cpu;
+    bool queued = p->state == RUNNABLE;
+    if (queued)
+        dequeue_proc(p, cpu);
+    p->schinfo.policy = policy;
+    p->schinfo.rt_prio = rt_prio;
+    if (queued) {
+        place_entity(&p->container->schqueue[cpu], &p->schinfo);
+        enqueue_proc(p, cpu);
+    }
+    _release_spinlock(&s->lock);
+    return 0;
+}
+
+// The first proc queued under `c` on `cpu` that may no longer run there
+static struct proc* first_stray(struct container* c, int cpu)
+{
+    for (auto node = _rb_first(&c->schqueue[cpu].sched_root); node; node = _rb_next(node)) {
+        auto se = container_of(node, struct schinfo, rbnode);
+        if (se->is_container) {
+            auto p = first_stray(container_of(se, struct container, schinfo[cpu]), cpu);
+            if (p)
+                return p;
+        } else if (!cpu_allowed(container_of(se, struct proc, schinfo), cpu)) {
+            return container_of(se, struct proc, schinfo);
+        }
+    }
+    return NULL;
+}
+
+// A proc queued on `cpu`, whose lock must be held, that may no longer run
+// there. Throttled containers are out of the tree, so look in them too.
+static struct proc* find_stray(int cpu)
+{
+    auto s = &cpus[cpu].sched;
+    for (int prio = 0; prio < RT_NR_PRIO; prio++) {
+        auto q = &s->rt.queue[prio];
+        _for_in_list(node, q) {
+            if (node == q) continue;
+            auto p = container_of(container_of(node, struct schinfo, rt_node), struct proc, schinfo);
+            if (!cpu_allowed(p, cpu))
+                return p;
+        }
+    }
+    auto p = first_stray(&root_container, cpu);
+    _for_in_list(node, &s->throttled) {
+        if (p || node == &s->throttled) continue;
+        p = first_stray(container_of(node, struct container, throttled_node[cpu]), cpu);
+    }
+    return p;
+}
+
+// Move every proc queued on `cpu` that may no longer run there to a cpu it
+// may use, holding both locks for each move like _activate_proc(). If the
+// proc running there may not either, interrupt it so that it gets switched
+// out, queued back and pushed in turn.
+static void push_strays(int cpu)
+{
+    auto s = &cpus[cpu].sched;
+    _acquire_spinlock(&s->lock);
+    struct proc* p;
+    while ((p = find_stray(cpu))) {
+        int target = least_loaded_cpu(allowed_cpus(p));
+        auto ts = &cpus[target].sched;
+        if (!_try_acquire_spinlock(&ts->lock)) {
+            // Locks are taken in no fixed order: let the other cpu through
+            _release_spinlock(&s->lock);
+            _acquire_spinlock(&s->lock);
+            continue;
+        }
+        dequeue_proc(p, cpu);
+        migrate_vruntime(&p->schinfo, &p->container->schqueue[cpu],
+                         &p->container->schqueue[target]);
+        p->schinfo.cpu = target;
+        enqueue_proc(p, target);
+        bool rt_kick = p->schinfo.policy != SCHED_NORMAL && rt_should_preempt(ts);
+        _release_spinlock(&ts->lock);
+        if (rt_kick)
+            send_ipi(target);
         else
-            mintime = container_of(minNode, struct schinfo, rbnode)->vruntime;
-        p->schinfo.vruntime = mintime;
-        ASSERT(_rb_insert(&p->schinfo.rbnode, schedQ, _schedtree_node_cmp) == 0);
-        _release_sched_lock();
+            kick_cpu(target);
+    }
+    if (!s->thisproc->idle && !cpu_allowed(s->thisproc, cpu))
+        send_ipi(cpu);
+    _release_spinlock(&s->lock);
+}
+
+int set_affinity(struct proc* p, u64 mask)
+{
+    mask &= CPUMASK_ALL;
+    if (mask == 0)
+        return -1;
+    auto s = lock_proc_rq(p);
+    p->schinfo.cpus_allowed = mask;
+    int cpu = p->schinfo.cpu;
+    bool stray = (p->state == RUNNABLE || p->state == RUNNING) && !cpu_allowed(p, cpu);
+    _release_spinlock(&s->lock);
+    if (stray)
+        push_strays(cpu);
+    return 0;
+}
+
+int set_container_affinity(struct container* c, u64 mask)
+{
+    mask &= CPUMASK_ALL;
+    if (mask == 0)
+        return -1;
+    c->cpus_allowed = mask;
+    // Only cpus outside the new mask can have procs of c, or of the
+    // containers under it, that may no longer be there
+    for (int i = 0; i < NCPU; i++)
+        if (!((mask >> i) & 1))
+            push_strays(i);
+    return 0;
+}
+
+void set_container_shares(struct container* c, u32 shares)
+{
+    ASSERT(shares > 0);
+    for (int i = 0; i < NCPU; i++) {
+        auto s = &cpus[i].sched;
+        _acquire_spinlock(&s->lock);
+        c->schinfo[i].weight = shares;
+        _release_spinlock(&s->lock);
+    }
+}
+
+// Virtual time for `run` cycles on an entity of `weight`
+static u64 weighted_runtime(u64 run, u32 weight)
+{
+    return run * NICE_0_WEIGHT / weight;
+}
+
+// CFS bandwidth control. Each cpu takes a container's quota out of the
+// shared pool in slices of BW_SLICE_MS, so that cpus do not all run on the
+// same remaining quota at once. A cpu that cannot get another slice
+// throttles the container: its group entity leaves the parent's queue on
+// that cpu until the cpu's bw_timer finds quota again in a later period.
+#define BW_SLICE_MS 5
+
+static struct timer bw_timer[NCPU];
+
+// Start a new period if the last one is over. Time run past the quota,
+// which cpus only notice at their next switch, is carried over so that it
+// does not add up. Must hold c->bw_lock.
+static void bw_refresh(struct container* c, u64 now)
+{
+    u64 period = ms_to_cycles(c->cfs_period_ms);
+    u64 n = (now - c->bw_period_start) / period;
+    if (n > 0) {
+        u64 refill = n * ms_to_cycles(c->cfs_quota_ms);
+        c->bw_period_start += n * period;
+        c->bw_used = c->bw_used > refill ? c->bw_used - refill : 0;
+    }
+}
+
+// Pay `debt` cycles run beyond the slice `cpu` held, then move a new
+// slice from the pool to `cpu`. Returns false if there is none left.
+static bool bw_refill(struct container* c, int cpu, u64 debt)
+{
+    if (c->cfs_quota_ms == 0)
+        return true;
+    _acquire_spinlock(&c->bw_lock);
+    bw_refresh(c, get_timestamp());
+    u64 quota = ms_to_cycles(c->cfs_quota_ms);
+    c->bw_used += debt;
+    u64 slice = c->bw_used < quota ? MIN(ms_to_cycles(BW_SLICE_MS), quota - c->bw_used) : 0;
+    c->bw_used += slice;
+    c->bw_local[cpu] = slice;
+    _release_spinlock(&c->bw_lock);
+    return slice > 0;
+}
+
+// Charge `run` cycles to the slice `cpu` holds. Returns false if `c` is
+// out of quota.
+static bool bw_charge(struct container* c, int cpu, u64 run)
+{
+    if (c->bw_local[cpu] > run) {
+        c->bw_local[cpu] -= run;
         return true;
     }
-    else return false;
+    return bw_refill(c, cpu, run - c->bw_local[cpu]);
+}
+
+// Arm this cpu's bw_timer for the earliest period end of the containers
+// throttled here, or stop it if there are none.
+static void bw_arm_timer()
+{
+    int cid = cpuid();
+    auto s = &cpus[cid].sched;
+    auto t = &bw_timer[cid];
+    if (!t->triggered)
+        cancel_cpu_timer(t);
+    t->triggered = true;
+    if (_empty_list(&s->throttled))
+        return;
+    u64 now = get_timestamp(), left = (u64) -1;
+    _for_in_list(node, &s->throttled) {
+        if (node == &s->throttled)
+            continue;
+        auto c = container_of(node, struct container, throttled_node[cid]);
+        u64 end = c->bw_period_start + ms_to_cycles(c->cfs_period_ms);
+        left = MIN(left, end > now ? end - now : 0);
+    }
+    t->elapse = left / ms_to_cycles(1) + 1;
+    set_cpu_timer(t);
+}
+
+static void throttle(struct container* c, int cpu)
+{
+    c->throttled[cpu] = true;
+    if (c->schqueue[cpu].nr_queued > 0)
+        dequeue_entity(c->parent, &c->schinfo[cpu], cpu);
+    _insert_into_list(&cpus[cpu].sched.throttled, &c->throttled_node[cpu]);
+    bw_arm_timer();
 }
 
-void activate_group(struct container* group)
+static void unthrottle(struct container* c, int cpu)
 {
-    struct container* parent = group->parent;
+    c->throttled[cpu] = false;
+    _detach_from_list(&c->throttled_node[cpu]);
+    if (c->schqueue[cpu].nr_queued > 0) {
+        auto se = &c->schinfo[cpu];
+        place_entity(&c->parent->schqueue[cpu], se);
+        enqueue_entity(c->parent, se, cpu);
+    }
+}
+
+static void bw_timer_handler(struct timer* t)
+{
+    int cid = cpuid();
+    auto s = &cpus[cid].sched;
     _acquire_sched_lock();
-    rb_node minNode = _rb_first(&parent->schqueue.sched_root);
-    u64 minTime = (minNode == NULL) ? 0 : container_of(minNode, struct schinfo, rbnode)->vruntime;
-    group->schinfo.vruntime = minTime;
-    ASSERT(_rb_insert(&group->schinfo.rbnode, &parent->schqueue.sched_root, _schedtree_node_cmp) == 0);
+    for (auto node = s->throttled.next; node != &s->throttled; ) {
+        auto c = container_of(node, struct container, throttled_node[cid]);
+        node = node->next;
+        if (bw_refill(c, cid, 0))
+            unthrottle(c, cid);
+    }
+    bw_arm_timer();
+    // The idle loop picks up unthrottled procs once wfi returns
+    if (!s->thisproc->idle && s->tick_extended)
+        arm_sched_tick(time_slice_ms(s->nr_running));
     _release_sched_lock();
+    (void) t;
+}
+
+define_early_init(bw_timer) {
+    for (int i = 0; i < NCPU; i++) {
+        bw_timer[i].handler = bw_timer_handler;
+        bw_timer[i].triggered = true;
+    }
+}
+
+// Longest tick before thisproc runs one of its containers past the slice
+// of quota it holds on `cpu`, or -1 if none of them has a quota.
+static u64 bw_tick_ms(struct proc* p, int cpu)
+{
+    u64 left = (u64) -1;
+    for (auto c = p->container; c; c = c->parent) {
+        if (c->cfs_quota_ms == 0)
+            continue;
+        if (c->bw_local[cpu] == 0)
+            bw_refill(c, cpu, 0);
+        left = MIN(left, c->bw_local[cpu]);
+    }
+    return left == (u64) -1 ? left : left / ms_to_cycles(1) + 1;
+}
+
+void set_container_quota(struct container* c, u64 quota_ms, u64 period_ms)
+{
+    ASSERT(c != &root_container && period_ms > 0);
+    _acquire_spinlock(&c->bw_lock);
+    c->cfs_quota_ms = quota_ms;
+    c->cfs_period_ms = period_ms;
+    c->bw_used = 0;
+    c->bw_period_start = get_timestamp();
+    _release_spinlock(&c->bw_lock);
 }
 
 static void update_this_state(enum procstate new_state)
 {
     // This rountine is PROTECTED BY SCHED LOCK
     auto p = thisproc();
+    int cid = cpuid();
+    auto s = &cpus[cid].sched;
     ASSERT(p->state == RUNNING);
     p->state = new_state;
+    bool preempted = s->preempting;
+    s->preempting = false;
+    // A proc that may no longer run here is still queued back here: no
+    // other cpu may take it before its context is saved. pick_next()
+    // passes it over, and finish_sched() pushes it away after the switch.
+    if (!p->idle && new_state == RUNNABLE && !cpu_allowed(p, cid))
+        s->stray = true;
     if (!p->idle) {
+        u64 time = p->schinfo.traptime ? p->schinfo.traptime : get_timestamp();
+        u64 run = (p->schinfo.lastrun && time > p->schinfo.lastrun) ? time - p->schinfo.lastrun : 0;
+        p->schinfo.traptime = 0; // in case it stays in kernel mode so that traptime won't be reset
+        p->schinfo.lastrun = 0; // in case it goes to sleep but clock still ticking
+        p->schinfo.last_ran = time;
+        if (new_state == RUNNABLE)
+            p->schinfo.queued_at = time;
+        // It has been running since it was picked, and so have its
+        // containers on this cpu
+        pelt_update(&p->schinfo.avg, time, true, true, p->schinfo.weight);
+        if (p->schinfo.policy == SCHED_NORMAL)
+            for (auto c = p->container; c; c = c->parent)
+                pelt_update_group(c, cid, time);
+        // Other cpus charge the same containers without our lock
+        for (auto c = p->container; c; c = c->parent)
+            __atomic_fetch_add(&c->cpu_time, run, __ATOMIC_RELAXED);
+        if (p->schinfo.policy != SCHED_NORMAL) {
+            rt_charge(&s->rt, run);
+            // A preempted FIFO proc keeps its place at the head of its
+            // priority; yielding or an expired RR slice goes to the tail
+            if (new_state == RUNNABLE) {
+                rt_enqueue(&s->rt, &p->schinfo, preempted && p->schinfo.policy == SCHED_FIFO);
+                s->nr_running++;
+            }
+            return;
+        }
         // Update vruntime for p and its containers
-        u64 time = (p->schinfo.traptime > 0) ? p->schinfo.traptime : get_timestamp_ms();
-        u64 run = (p->schinfo.lastrun > 0) ? time - p->schinfo.lastrun : 0;
-        p->schinfo.traptime = -1; // in case it stays in kernel mode so that traptime won't be reset
-        p->schinfo.lastrun = -1; // in case it goes to sleep but clock still ticking
-        p->schinfo.vruntime += run;
+        p->schinfo.vruntime += weighted_runtime(run, p->schinfo.weight);
+        update_min_vruntime(&p->container->schqueue[cid], p->schinfo.vruntime);
         struct container* con = p->container;
         while(run > 0 && con != &root_container) {
-            con->schinfo.vruntime += run;
-            _rb_erase(&con->schinfo.rbnode, &con->parent->schqueue.sched_root);
-            ASSERT(_rb_insert(&con->schinfo.rbnode, &con->parent->schqueue.sched_root, _schedtree_node_cmp) == 0);
+            auto se = &con->schinfo[cid];
+            auto sq = &con->parent->schqueue[cid];
+            se->vruntime += weighted_runtime(run, se->weight);
+            // Requeue to keep the parent's tree ordered, if it is queued
+            if (con->schqueue[cid].nr_queued > 0 && !con->throttled[cid]) {
+                _rb_erase(&se->rbnode, &sq->sched_root);
+                ASSERT(_rb_insert(&se->rbnode, &sq->sched_root, _schedtree_node_cmp) == 0);
+            }
+            update_min_vruntime(sq, se->vruntime);
             con = con->parent;
         }
+        for (auto c = p->container; c; c = c->parent)
+            if (c->cfs_quota_ms && !bw_charge(c, cid, run) && !c->throttled[cid])
+                throttle(c, cid);
         if (new_state == RUNNABLE)
-            ASSERT(_rb_insert(&p->schinfo.rbnode, &p->container->schqueue.sched_root, _schedtree_node_cmp) == 0);
+            enqueue_proc(p, cid);
     }
 }
 
-static rb_node _get_first_runnable(rb_node root) {
-    // Sched-lock REQUIRED
-    if (root == NULL) return NULL;
-    
-    // Check left subtree
-    rb_node res = _get_first_runnable(root->rb_left);
-    if (res != NULL) return res;
-
-    // Then check itself
-    auto s = container_of(root, struct schinfo, rbnode);
-    if (s->is_container) {
-        auto c = container_of(s, struct container, schinfo);
-        res = _get_first_runnable(c->schqueue.sched_root.rb_node);
-        if (res != NULL) return res;
-    }
-    else {
-        return root;
+// Take the first proc of the highest RT priority that may run on this cpu
+// off its rt_rq, or return NULL
+static struct proc* rt_dequeue_first(struct sched* s)
+{
+    for (int prio = rt_top_prio(&s->rt); prio >= 0; prio--) {
+        auto q = &s->rt.queue[prio];
+        _for_in_list(node, q) {
+            if (node == q) continue;
+            auto se = container_of(node, struct schinfo, rt_node);
+            auto p = container_of(se, struct proc, schinfo);
+            if (!cpu_allowed(p, cpuid()))
+                continue;
+            rt_dequeue(&s->rt, se);
+            s->nr_running--;
+            return p;
+        }
     }
+    return NULL;
+}
 
-    // Last check right subtree
-    res = _get_first_runnable(root->rb_right);
-    return res;
+// The first proc queued under `c` on `cpu`, in vruntime order, that may
+// run on `target`. Only containers with something runnable are queued,
+// so without affinity masks this is the leftmost entity of each level.
+static struct schinfo* first_allowed(struct container* c, int cpu, int target)
+{
+    for (auto node = _rb_first(&c->schqueue[cpu].sched_root); node; node = _rb_next(node)) {
+        auto se = container_of(node, struct schinfo, rbnode);
+        if (se->is_container) {
+            se = first_allowed(container_of(se, struct container, schinfo[cpu]), cpu, target);
+            if (se)
+                return se;
+        } else if (cpu_allowed(container_of(se, struct proc, schinfo), target)) {
+            return se;
+        }
+    }
+    return NULL;
 }
 
-static struct proc* pick_next()
+// Take the next CFS proc that may run on `target` off the run queue of
+// `cpu`, whose lock must be held.
+static struct proc* dequeue_first(int cpu, int target)
 {
-    // This routine is PROTECTED BY SCHED LOCK
-    auto node = _get_first_runnable(root_container.schqueue.sched_root.rb_node);
-    if (node == NULL)
-        return cpus[cpuid()].sched.idle;
+    auto se = first_allowed(&root_container, cpu, target);
+    if (se == NULL)
+        return NULL;
+    auto p = container_of(se, struct proc, schinfo);
+    dequeue_entity(p->container, se, cpu);
+    cpus[cpu].sched.nr_running--;
+    return p;
+}
 
-    auto p = container_of(node, struct proc, schinfo.rbnode);
-    auto c = p->container;
-    _rb_erase(node, &c->schqueue.sched_root);
+// Move a proc from the cpu with the most queued procs, if it has more than
+// `load`, to this cpu. Ties go to the cpu with the higher recent load. We
+// already hold our own lock, so the victim's lock is only tried, never
+// waited for.
+static struct proc* steal_proc(int load)
+{
+    int cid = cpuid(), victim = -1;
+    for (int i = 0; i < NCPU; i++) {
+        int n = cpus[i].sched.nr_running;
+        if (i == cid)
+            continue;
+        if (n > load || (n == load && victim >= 0 && cpu_load_avg(i) > cpu_load_avg(victim))) {
+            victim = i;
+            load = n;
+        }
+    }
+    if (victim < 0)
+        return NULL;
+    auto vs = &cpus[victim].sched;
+    if (!_try_acquire_spinlock(&vs->lock))
+        return NULL;
+    auto p = dequeue_first(victim, cid);
+    if (p) {
+        migrate_vruntime(&p->schinfo, &p->container->schqueue[victim],
+                         &p->container->schqueue[cid]);
+        p->schinfo.cpu = cid;
+    }
+    _release_spinlock(&vs->lock);
     return p;
 }
 
-static bool __my_timer_cmp(rb_node lnode, rb_node rnode) {
-    i64 d = container_of(lnode, struct timer, _node)->_key - container_of(rnode, struct timer, _node)->_key;
-    if (d < 0)
-        return true;
-    if (d == 0)
-        return lnode < rnode;
-    return false;
+static struct proc* pick_next()
+{
+    // This routine is PROTECTED BY SCHED LOCK
+    int cid = cpuid();
+    auto s = &cpus[cid].sched;
+    // Periodically pull a proc from a cpu with at least two more queued
+    u64 now = get_timestamp_ms();
+    if (now >= s->next_balance) {
+        s->next_balance = now + BALANCE_INTERVAL;
+        auto p = steal_proc(s->nr_running + 1);
+        if (p)
+            enqueue_proc(p, cid);
+        // More than the proc about to run is queued here: idle cpus do not
+        // tick, so wake one up to steal the rest
+        if (s->nr_running > 1)
+            kick_idle_cpu();
+    }
+    // RT procs go first. Once throttled, they only get what CFS leaves.
+    rt_update_period(&s->rt);
+    struct proc* p = NULL;
+    if (s->rt.nr_running > 0 && (!s->rt.throttled || s->nr_running == s->rt.nr_running))
+        p = rt_dequeue_first(s);
+    if (p)
+        return p;
+    p = dequeue_first(cid, cid);
+    // Nothing to run here: steal from the busiest cpu before going idle
+    if (p == NULL)
+        p = steal_proc(0);
+    if (p == NULL)
+        return s->idle;
+    return p;
 }
 
 static void update_this_proc(struct proc* p)
 {
     // This routine is PROTECTED BY SCHED LOCK
     // update thisproc to the choosen process, and reset the clock interrupt if need
+    auto s = &cpus[cpuid()].sched;
+    auto st = &s->stat;
+    u64 now = get_timestamp();
+    pelt_update_cpu(cpuid(), now);
+    if (!p->idle) {
+        // It has been waiting since it was queued
+        pelt_update(&p->schinfo.avg, now, true, false, p->schinfo.weight);
+        if (p->schinfo.policy == SCHED_NORMAL)
+            for (auto c = p->container; c; c = c->parent)
+                pelt_update_group(c, cpuid(), now);
+    }
     p->state = RUNNING;
-    cpus[cpuid()].sched.thisproc = p;
+    if (s->thisproc != p) {
+        if (s->thisproc->idle)
+            st->idle_cycles += now - st->idle_start;
+        if (p->idle)
+            st->idle_start = now;
+    }
+    if (!p->idle && p->schinfo.queued_at) {
+        u64 wait = now - p->schinfo.queued_at;
+        st->wait_cycles += wait;
+        st->wait_hist[latency_bucket(wait)]++;
+        p->schinfo.queued_at = 0;
+    }
+    s->thisproc = p;
 
     // reset schedinfo timer
-    p->schinfo.lastrun = get_timestamp_ms();
+    p->schinfo.lastrun = now;
 
     // reset cpu sched timer
-    auto check = _rb_lookup(&(sched_timer[cpuid()]._node), &(cpus[cpuid()].timer), __my_timer_cmp);
-    if (check) 
-        cancel_cpu_timer(&sched_timer[cpuid()]);
-    set_cpu_timer(&sched_timer[cpuid()]);
+    u64 ms;
+    bool extend = false;
+    if (!sched_tickless) {
+        ms = time_slice_ms(s->nr_running);
+    } else if (p->schinfo.policy != SCHED_NORMAL && !s->rt.throttled) {
+        // Come back when the budget runs out, or the RR slice does
+        u64 budget = ms_to_cycles(sched_rt_runtime_ms) - s->rt.runtime;
+        ms = budget / ms_to_cycles(1) + 1;
+        if (p->schinfo.policy == SCHED_RR)
+            ms = MIN(ms, (u64) RT_RR_SLICE_MS);
+    } else if (p->idle) {
+        // No tick: wakeups and busy cpus send an IPI when there is work,
+        // and other timers still fire on time
+        ms = sched_wakeup_ipi ? 0 : IDLE_BALANCE_MS;
+    } else if (s->nr_running == 0) {
+        ms = SINGLE_TICK_MS;
+        extend = true;
+    } else {
+        ms = time_slice_ms(s->nr_running);
+    }
+    // Don't overrun the quota of its containers
+    if (!p->idle && p->schinfo.policy == SCHED_NORMAL) {
+        u64 bw = bw_tick_ms(p, cpuid());
+        if (bw < ms) {
+            ms = bw;
+            extend = false;
+        }
+    }
+    arm_sched_tick(ms);
+    s->tick_extended = extend;
+}
+
+// Release the run queue lock at the end of a switch, on the stack of the
+// proc switched to. The one switched out has its context saved by now, so
+// it may be pushed to another cpu if it was a stray.
+static void finish_sched()
+{
+    auto s = &cpus[cpuid()].sched;
+    bool stray = s->stray;
+    s->stray = false;
+    _release_sched_lock();
+    if (stray)
+        push_strays(cpuid());
 }
 
 static void simple_sched(enum procstate new_state)
@@ -240,16 +1223,24 @@ static void simple_sched(enum procstate new_state)
     auto this = thisproc();
     ASSERT(this->state == RUNNING);
     if (this->killed && new_state != ZOMBIE) {
+        cpus[cpuid()].sched.preempting = false;
         _release_sched_lock();
         return;
     }
 
+    auto st = &cpus[cpuid()].sched.stat;
+    bool preempted = cpus[cpuid()].sched.preempting;
     update_this_state(new_state); // update vruntime, insert node if RUNNABLE && not idle
     auto next = pick_next(); // Choose proc with minimum vruntime, erase node
     ASSERT(next == this || next->state == RUNNABLE);
     update_this_proc(next); // set next.lastrun, set cpu sched timer
     if (next != this)
     {
+        st->nr_switches++;
+        if (preempted)
+            st->nr_involuntary++;
+        else
+            st->nr_voluntary++;
         #ifdef DEBUG_LOG_SCHEDINFO
         printk("CPU %d: pid %d switch to pid %d\n", cpuid(), this->pid, next->pid);
         #endif
@@ -261,14 +1252,52 @@ static void simple_sched(enum procstate new_state)
         #endif
     }
     if (!thisproc()->idle) ASSERT(thisproc()->parent->state >= 1 && thisproc()->parent->state <= 4);
-    _release_sched_lock();
+    finish_sched();
+}
+
+void preempt()
+{
+    _acquire_sched_lock();
+    cpus[cpuid()].sched.preempting = true;
+    _sched(RUNNABLE);
+}
+
+void sched_stats_dump()
+{
+    static const char* const bucket_name[SCHED_NR_BUCKETS] = {
+        "<10us", "<100us", "<1ms", "<10ms", "<100ms", ">=100ms"};
+    u64 one_ms = get_clock_frequency() / 1000;
+    printk("sched stats:\n");
+    for (int i = 0; i < NCPU; i++) {
+        auto s = &cpus[i].sched;
+        auto st = &s->stat;
+        printk("  CPU %d: %llu switches (%llu voluntary, %llu involuntary), idle %llu ms,"
+               " lock held %llu ms\n", i, st->nr_switches, st->nr_voluntary,
+               st->nr_involuntary, st->idle_cycles / one_ms, s->lock_cycles / one_ms);
+        printk("    load avg %llu, util avg %llu/%d\n", cpu_load_avg(i), cpu_util_avg(i),
+               PELT_SCALE);
+        printk("    run queue wait %llu ms:", st->wait_cycles / one_ms);
+        for (int j = 0; j < SCHED_NR_BUCKETS; j++)
+            printk(" %s %llu", bucket_name[j], st->wait_hist[j]);
+        printk("\n    lock holds:");
+        for (int j = 0; j < SCHED_NR_BUCKETS; j++)
+            printk(" %s %llu", bucket_name[j], st->lock_hist[j]);
+        printk("\n");
+    }
+    printk("  root container: %llu ms of cpu time\n", root_container.cpu_time / one_ms);
+}
+
+define_syscall(sched_stats)
+{
+    sched_stats_dump();
+    return 0;
 }
 
 __attribute__((weak, alias("simple_sched"))) void _sched(enum procstate new_state);
 
 u64 proc_entry(void(*entry)(u64), u64 arg)
 {
-    _release_sched_lock();
+    finish_sched();
     set_return_addr(entry);
     return arg;
 }
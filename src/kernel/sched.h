@@ -4,6 +4,41 @@
 
 #define RR_TIME 1000
 
+// Weight of a nice 0 proc, and the default cpu.shares of a container
+#define NICE_0_WEIGHT 1024
+
+// Affinity mask allowing every cpu
+#define CPUMASK_ALL ((1ull << NCPU) - 1)
+
+// Scheduling policies. FIFO and RR procs form the real-time class: they
+// always run before SCHED_NORMAL (CFS) procs, highest rt_prio first.
+// A FIFO proc runs until it blocks or yields; RR procs of the same
+// priority take turns every RT_RR_SLICE_MS.
+#define SCHED_NORMAL 0
+#define SCHED_FIFO 1
+#define SCHED_RR 2
+#define RT_RR_SLICE_MS 100
+
+// Target period in which every runnable proc of a cpu gets a turn, and
+// the shortest time slice handed out when many procs share that period.
+// Slices are never shorter than 2 ms, whatever the granularity is set to.
+extern u64 sched_latency_ms;
+extern u64 sched_min_granularity_ms;
+// Stop the sched timer on idle cpus and stretch it when only one proc is
+// runnable on a cpu.
+extern bool sched_tickless;
+// RT procs of a cpu may run at most sched_rt_runtime_ms out of every
+// sched_rt_period_ms while CFS procs are waiting on it.
+extern u64 sched_rt_period_ms;
+extern u64 sched_rt_runtime_ms;
+// Wake a proc up on the cpu it last ran on if that cpu is idle, or lightly
+// loaded and the proc ran there less than sched_migration_cost_ms ago.
+// Otherwise, or if this is off, wake it on the least loaded cpu.
+extern bool sched_wake_prev_cpu;
+extern u64 sched_migration_cost_ms;
+// Send an IPI to an idle cpu when a proc is woken up onto it.
+extern bool sched_wakeup_ipi;
+
 void init_schinfo(struct schinfo*, bool group);
 void init_schqueue(struct schqueue*);
 
@@ -20,5 +55,36 @@ void _sched(enum procstate new_state);
 // MUST call lock_for_sched() before sched() !!!
 #define sched(checker, new_state) (checker_end_ctx(checker), _sched(new_state))
 #define yield() (_acquire_sched_lock(), _sched(RUNNABLE))
+// yield() on behalf of the tick or an IPI
+void preempt();
 
 WARN_RESULT struct proc* thisproc();
+
+// Recent load of a cpu or a container, from exponentially decayed averages
+// with a half-life of 32 ms. Load is the weighted runnable average, and
+// util the running average, out of PELT_SCALE per cpu.
+#define PELT_SCALE 1024
+u64 cpu_load_avg(int cpu);
+u64 cpu_util_avg(int cpu);
+u64 container_load_avg(struct container*);
+u64 container_util_avg(struct container*);
+
+// Print the per-cpu scheduler counters and the cpu time of root_container
+void sched_stats_dump();
+
+// Set the nice value of `p`, clamped to [-20, 19]. Each step is worth
+// about 10% of cpu time against a proc one step away.
+void set_nice(struct proc*, int nice);
+// Set the cpu.shares of a container: its weight against its siblings.
+void set_container_shares(struct container*, u32 shares);
+// Restrict `p`, or every proc of a container, to the cpus in `mask`. A
+// proc may run where both its own mask and those of all its containers
+// allow; if they do not overlap, its own mask wins. Procs queued on a cpu
+// they may no longer use are moved to one they may use, and those running
+// on one are interrupted to be moved in turn.
+// Return -1 if `mask` has no valid cpu.
+int set_affinity(struct proc*, u64 mask);
+int set_container_affinity(struct container*, u64 mask);
+// Set the policy of `p`, and its priority in [0, RT_NR_PRIO) for FIFO/RR.
+// Returns -1 if either is invalid.
+int set_sched_policy(struct proc*, int policy, int rt_prio);
@@ -1,28 +1,117 @@
 #pragma once
 
+#include <common/bitmap.h>
 #include <common/list.h>
 #include <common/rbtree.h>
+#include <common/spinlock.h>
 struct proc; // dont include proc.h here
 
+// Priorities of the real-time class, higher runs first
+#define RT_NR_PRIO 64
+
+// Real-time run queue of a cpu: a FIFO list per priority, and a bitmap of
+// the non-empty ones so the highest is found in O(1)
+struct rt_rq
+{
+    Bitmap(bitmap, RT_NR_PRIO);
+    ListNode queue[RT_NR_PRIO];
+    int nr_running;
+    // Cycles run by RT procs in the period started at period_start
+    u64 period_start, runtime;
+    // Budget used up: CFS procs go first until the next period
+    bool throttled;
+};
+
+// Histogram buckets by latency decade: <10us, <100us, <1ms, <10ms,
+// <100ms, and the rest
+#define SCHED_NR_BUCKETS 6
+
+// Per-cpu scheduler counters, updated under the run queue lock
+struct sched_stat
+{
+    u64 nr_switches;
+    // Switches where the proc gave up the cpu itself, or was preempted
+    u64 nr_voluntary, nr_involuntary;
+    // Run queue wait, from RUNNABLE to RUNNING, in cycles
+    u64 wait_cycles, wait_hist[SCHED_NR_BUCKETS];
+    // How long each hold of the run queue lock took
+    u64 lock_hist[SCHED_NR_BUCKETS];
+    // Cycles spent running idle, and when it last started
+    u64 idle_cycles, idle_start;
+};
+
+// Load tracking (PELT): decayed sums over 1 ms periods, where a period
+// counts half as much as one 32 periods more recent
+struct sched_avg
+{
+    // Timestamp (cycles) the sums are up to, 0 if never updated
+    u64 last_update;
+    // Sums of the periods spent runnable / running, up to PELT_SUM_MAX
+    u64 load_sum, util_sum;
+    // Weight times the runnable fraction, and the running fraction out of
+    // PELT_SCALE
+    u64 load_avg, util_avg;
+};
+
 // embedded data for cpus
 struct sched
 {
     // customize your sched info
     struct proc* thisproc;
     struct proc* idle;
+    // Run queue lock. Guards this cpu's schqueue in every container and
+    // the procs queued on them.
+    SpinLock lock;
+    // Runnable procs queued on this cpu, not counting thisproc.
+    // Includes the ones on rt.
+    int nr_running;
+    struct rt_rq rt;
+    // Containers throttled on this cpu, by throttled_node[cpu]
+    ListNode throttled;
+    // thisproc is being switched out by the tick or an IPI, not by itself
+    bool preempting;
+    // Timestamp (ms) of the next periodic load balance
+    u64 next_balance;
+    // The sched timer was stretched because thisproc had no competition
+    bool tick_extended;
+    // thisproc was queued back here though it may no longer run here
+    bool stray;
+    // Cycles the run queue lock has been held by this cpu
+    u64 lock_start, lock_cycles;
+    struct sched_stat stat;
+    // Load of the cpu as a whole, as if it had weight NICE_0_WEIGHT
+    struct sched_avg avg;
 };
 
 // embeded data for procs
 struct schinfo
 {
     struct rb_node_ rbnode;
-    // Accumulative virtual runtime
+    // Accumulative virtual runtime: cycles run, scaled by NICE_0_WEIGHT / weight
     u64 vruntime;
-    // Timestamp of the last scheduled time
+    // Load weight: from the nice value for procs, cpu.shares for containers
+    u32 weight;
+    // Timestamp (cycles) of the last scheduled time, 0 if not running
     u64 lastrun;
-    // Timestamp of when it was trapped in from userspace
+    // Timestamp (cycles) of when it was trapped in from userspace, 0 if not
     u64 traptime;
     bool is_container;
+    // SCHED_NORMAL, SCHED_FIFO or SCHED_RR, and the RT priority
+    int policy, rt_prio;
+    // Node in the cpu's rt_rq, when queued there instead of the CFS tree
+    ListNode rt_node;
+    // Bit i set if the proc may run on cpu i
+    u64 cpus_allowed;
+    // Timestamp (cycles) of when it last became RUNNABLE
+    u64 queued_at;
+    // Recent load. For a group entity, runnable while anything in the
+    // container is queued or running on its cpu.
+    struct sched_avg avg;
+    // Timestamp (cycles) of when it last stopped running
+    u64 last_ran;
+    // The cpu whose run queue the proc is on, or last ran on.
+    // Only changes under that cpu's run queue lock.
+    int cpu;
 };
 
 // embedded data for containers
@@ -30,7 +119,14 @@ struct schqueue
 {
     // TODO: customize your sched queue
     struct rb_root_ sched_root;
-    // All schedqueue use the same global sched_lock
+    // Entities in sched_root. A container's group entity is queued in its
+    // parent exactly when its own queue is not empty and it is not
+    // throttled.
+    int nr_queued;
+    // Never decreasing lower bound of the vruntimes of the queued and
+    // running entities, which waking entities are placed against
+    u64 min_vruntime;
+    // Protected by the run queue lock of the cpu it belongs to
     // bool (*cmp)(rb_node lnode, rb_node rnode);
 };
 
@@ -11,7 +11,7 @@ void syscall_entry(UserContext* context)
     // Invoke syscall_table[id] with args and set the return value.
     // id is stored in x8. args are stored in x0-x5. return value is stored in x0.
     u64 id = context->x[8];
-    ASSERT(id==499);
+    ASSERT(id < NR_SYSCALL && syscall_table[id]);
     u64 ret;
     if (id < NR_SYSCALL)
     {
@@ -1,3 +1,6 @@
 #pragma once
 
-#define SYS_myreport 499
\ No newline at end of file
+#define SYS_myreport 499
+#define SYS_kmem_stats 500
+#define SYS_sched_setaffinity 501
+#define SYS_sched_stats 502
@@ -17,35 +17,69 @@ static short sz[4][10000];
         while (1)                                                              \
             ;                                                                  \
     }
-#define SYNC(i)                                                                \
+#define SYNC_ON(rc, i)                                                         \
     arch_dsb_sy();                                                             \
-    _increment_rc(&x);                                                         \
-    while (x.count < 4 * i)                                                    \
+    _increment_rc(&rc);                                                        \
+    while (rc.count < 4 * i)                                                   \
         ;                                                                      \
     arch_dsb_sy();
+#define SYNC(i) SYNC_ON(x, i)
 
-void alloc_test() {
-    int i = cpuid();
-    int r = alloc_page_cnt.count;
-    int y = 10000 - i * 500;
-    if (i == 0) printk("alloc_test\n");
-    SYNC(1)
+static u64 page_cycles[4][2];
+static u64 kalloc_cycles[4], kalloc_ops[4];
+
+// Allocate and free `y` pages, returning the cycles spent in
+// kalloc_page()/kfree_page() only (the content check is not counted).
+static u64 page_phase(int i, int y) {
+    u64 t, cycles = 0;
+    t = get_timestamp();
     for (int j = 0; j < y; j++) {
         p[i][j] = kalloc_page();
         if (!p[i][j] || ((u64)p[i][j] & 4095)) FAIL("FAIL: alloc_page() = %p\n", p[i][j]);
-        memset(p[i][j], i ^ j, PAGE_SIZE);
     }
+    cycles += get_timestamp() - t;
+    for (int j = 0; j < y; j++)
+        memset(p[i][j], i ^ j, PAGE_SIZE);
     for (int j = 0; j < y; j++) {
         u8 m = (i ^ j) & 255;
         for (int k = 0; k < PAGE_SIZE; k++)
             if (((u8*)p[i][j])[k] != m)
                 FAIL("FAIL: page[%d][%d] wrong\n", i, j);
-        kfree_page(p[i][j]);
     }
+    t = get_timestamp();
+    for (int j = 0; j < y; j++)
+        kfree_page(p[i][j]);
+    cycles += get_timestamp() - t;
+    return cycles;
+}
+
+void alloc_test() {
+    int i = cpuid();
+    int r = alloc_page_cnt.count;
+    int y = 10000 - i * 500;
+    if (i == 0) printk("alloc_test\n");
+    if (i == 0) page_cache_enabled = false;
+    SYNC(1)
+    page_cycles[i][0] = page_phase(i, y) / y;
     SYNC(2)
+    if (i == 0) page_cache_enabled = true;
+    SYNC(3)
+    page_cycles[i][1] = page_phase(i, y) / y;
+    page_cache_drain();
+    SYNC(4)
     if (alloc_page_cnt.count != r)
         FAIL("FAIL: alloc_page_cnt %d -> %lld\n", r, alloc_page_cnt.count);
-    SYNC(3)
+    if (i == 0) {
+        for (int j = 0; j < 4; j++)
+            printk("CPU %d: %llu cycles per page alloc/free (cache off), %llu (cache on)\n",
+                   j, page_cycles[j][0], page_cycles[j][1]);
+        page_zero_report();
+        for (int j = 0; j < NZONES; j++)
+            printk("Zone %d: %llu pages, %llu free, %llu allocated, %llu stolen\n", j,
+                   zone_stat[j].nr_pages, zone_stat[j].nr_free, zone_stat[j].nr_alloc,
+                   zone_stat[j].nr_stolen);
+    }
+    SYNC(5)
     for (int j = 0; j < 10000;) {
         if (j < 1000 || rand() > RAND_MAX / 16 * 7) {
             int z = 0;
@@ -66,7 +100,10 @@ void alloc_test() {
                 z = round_up((u64)z, 8ll);
             }
             sz[i][j] = z;
+            u64 t = get_timestamp();
             p[i][j] = kalloc(z);
+            kalloc_cycles[i] += get_timestamp() - t;
+            kalloc_ops[i]++;
             u64 q = (u64)p[i][j];
             if (p[i][j] == NULL || ((z & 1) == 0 && (q & 1) != 0) ||
                 ((z & 3) == 0 && (q & 3) != 0) ||
@@ -83,21 +120,196 @@ void alloc_test() {
                 if (((u8*)p[i][k])[t] != m)
                     FAIL("FAIL: block[%d][%d] wrong\n", i, k);
                     // FAIL("FAIL: block[%d][%d] at %llx wrong\n", i, k, (u64) p[i][k]);
+            u64 t = get_timestamp();
             kfree(p[i][k]);
+            kalloc_cycles[i] += get_timestamp() - t;
+            kalloc_ops[i]++;
             p[i][k] = p[i][--j];
             sz[i][k] = sz[i][j];
         }
     }
-    SYNC(4)
+    SYNC(6)
     if (cpuid() == 0) {
         i64 z = 0;
         for (int j = 0; j < 4; j++) for (int k = 0; k < 10000; k++)
             z += sz[j][k];
         printk("Total: %lld\nUsage: %lld\n", z, alloc_page_cnt.count - r);
+        for (int j = 0; j < 4; j++)
+            printk("CPU %d: %llu cycles per kalloc/kfree\n", j, kalloc_cycles[j] / kalloc_ops[j]);
     }
-    SYNC(5)
+    SYNC(7)
+    if (cpuid() == 0) kmem_report();
+    SYNC(8)
     for (int j = 0; j < 10000; j++)
         kfree(p[i][j]);
-    SYNC(6)
-    if (cpuid() == 0) printk("alloc_test PASS\n");
+    kmem_drain();
+    SYNC(9)
+    // Pick up what the other cpus flushed into our slabs
+    kmem_drain();
+    SYNC(10)
+    if (cpuid() == 0) {
+        kmem_report();
+        printk("Usage after free: %lld\n", alloc_page_cnt.count - r);
+    }
+    // Large objects: whole pages from the buddy allocator. Their sizes
+    // do not fit in sz[][].
+    int lsz[64];
+    for (int j = 0; j < 64; j++) {
+        int z = SLAB_MAX_SIZE + 1 + rand() % (PAGE_SIZE * 8);
+        lsz[j] = z;
+        p[i][j] = kalloc(z);
+        if (p[i][j] == NULL || PAGE_BASE((u64)p[i][j]) != (u64)p[i][j])
+            FAIL("FAIL: alloc(%d) = %p\n", z, p[i][j]);
+        memset(p[i][j], i ^ j, z);
+    }
+    for (int j = 0; j < 64; j++) {
+        for (int t = 0; t < lsz[j]; t++)
+            if (((u8*)p[i][j])[t] != ((i ^ j) & 255))
+                FAIL("FAIL: large block[%d][%d] wrong\n", i, j);
+        kfree(p[i][j]);
+    }
+    page_cache_drain();
+    SYNC(11)
+    if (cpuid() == 0) {
+        kmem_stats_dump();
+        printk("alloc_test PASS\n");
+    }
+}
+
+static RefCount bx;
+static int ord[4][1000];
+static u64 buddy_ops[4], buddy_cycles[4];
+
+static void print_buddy_stat(const char* when) {
+    u64 nr_free[MAX_ORDER], total = 0;
+    buddy_stat(nr_free);
+    printk("%s:", when);
+    for (int k = 0; k < MAX_ORDER; k++) {
+        printk(" %llu", nr_free[k]);
+        total += nr_free[k] << k;
+    }
+    // Share of free memory that cannot back a 2 MiB (order-9) allocation
+    u64 big = (nr_free[9] << 9) + (nr_free[10] << 10);
+    printk("\n  free pages %llu, fragmentation %llu%%\n", total,
+           total ? (total - big) * 100 / total : 0);
+}
+
+// Mixed-order allocate/free workload on the buddy allocator, run on all cpus.
+void buddy_test() {
+    int i = cpuid();
+    int r = alloc_page_cnt.count;
+    if (i == 0) printk("buddy_test\n");
+    page_cache_drain();
+    SYNC_ON(bx, 1)
+    if (i == 0) print_buddy_stat("free blocks by order before");
+    SYNC_ON(bx, 2)
+    u64 t = get_timestamp();
+    int n = 0;
+    for (int round = 0; round < 20000; round++) {
+        if (n < 1000 && (n == 0 || rand() > RAND_MAX / 16 * 7)) {
+            // mostly small blocks, occasionally up to 2 MiB
+            int k = rand() & 255;
+            k = k < 128 ? 0 : k < 192 ? 1 : k < 224 ? 2 : k < 248 ? rand() % 4 + 3 : rand() % 3 + 7;
+            p[i][n] = kalloc_pages(k);
+            if (p[i][n] == NULL)
+                continue;
+            if (K2P(p[i][n]) & ((PAGE_SIZE << k) - 1))
+                FAIL("FAIL: alloc_pages(%d) = %p\n", k, p[i][n]);
+            *(int*)p[i][n] = i ^ k;
+            ord[i][n++] = k;
+        } else {
+            int j = rand() % n;
+            if (*(int*)p[i][j] != (i ^ ord[i][j]))
+                FAIL("FAIL: pages[%d][%d] wrong\n", i, j);
+            kfree_pages(p[i][j], ord[i][j]);
+            p[i][j] = p[i][--n];
+            ord[i][j] = ord[i][n];
+        }
+        buddy_ops[i]++;
+    }
+    buddy_cycles[i] = get_timestamp() - t;
+    SYNC_ON(bx, 3)
+    if (i == 0) print_buddy_stat("free blocks by order under load");
+    SYNC_ON(bx, 4)
+    for (int j = 0; j < n; j++)
+        kfree_pages(p[i][j], ord[i][j]);
+    page_cache_drain();
+    SYNC_ON(bx, 5)
+    if (alloc_page_cnt.count != r)
+        FAIL("FAIL: alloc_page_cnt %d -> %lld\n", r, alloc_page_cnt.count);
+    if (i == 0) {
+        print_buddy_stat("free blocks by order after");
+        for (int j = 0; j < 4; j++)
+            printk("CPU %d: %llu ops, %llu cycles per op\n", j, buddy_ops[j],
+                   buddy_cycles[j] / buddy_ops[j]);
+        printk("buddy_test PASS\n");
+    }
+}
+
+#define RING_SIZE 256
+#define RF_OBJS 200000
+
+static RefCount rx;
+static struct {
+    void* slot[RING_SIZE];
+    volatile u64 head, tail;
+} ring[2];
+static u64 rf_cycles[4];
+static struct kmem_cache* rf_cache;
+static void* rf_objs[KMEM_CPU_CACHE_BATCH];
+
+// CPU 0 and 1 kalloc objects and pass them to CPU 2 and 3, which kfree them.
+// Every free is a remote free into a slab owned by the producer.
+void remote_free_test() {
+    int i = cpuid();
+    int r = alloc_page_cnt.count;
+    if (i == 0) printk("remote_free_test\n");
+    auto q = &ring[i & 1];
+    if (i < 2) q->head = q->tail = 0;
+    if (i == 0 && rf_cache == NULL) rf_cache = kmem_cache_create("rf_test", 64, NULL);
+    SYNC_ON(rx, 1)
+    u64 t = get_timestamp();
+    if (i < 2) {
+        for (int j = 0; j < RF_OBJS; j++) {
+            int z = (j & 7) * 8 + 8;
+            u64* o = kalloc(z);
+            o[0] = j;
+            while (q->head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == RING_SIZE)
+                ;
+            q->slot[q->head % RING_SIZE] = o;
+            __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+        }
+    } else {
+        for (int j = 0; j < RF_OBJS; j++) {
+            while (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == q->tail)
+                ;
+            u64* o = q->slot[q->tail % RING_SIZE];
+            if (o[0] != (u64)j)
+                FAIL("FAIL: object %d from CPU %d wrong\n", j, i - 2);
+            __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+            kfree(o);
+        }
+    }
+    rf_cycles[i] = get_timestamp() - t;
+    SYNC_ON(rx, 2)
+    // Objects of CPU 1's slabs end up in CPU 0's cache: the objects in use
+    // must still add up to none
+    if (i == 1)
+        for (int j = 0; j < KMEM_CPU_CACHE_BATCH; j++)
+            rf_objs[j] = kmem_cache_alloc(rf_cache);
+    SYNC_ON(rx, 3)
+    if (i == 0) {
+        for (int j = 0; j < KMEM_CPU_CACHE_BATCH; j++)
+            kmem_cache_free(rf_cache, rf_objs[j]);
+        if (kmem_cache_inuse(rf_cache) != 0)
+            FAIL("FAIL: %lld rf_test objects in use\n", kmem_cache_inuse(rf_cache));
+    }
+    SYNC_ON(rx, 4)
+    if (i == 0) {
+        for (int j = 0; j < 4; j++)
+            printk("CPU %d (%s): %llu objects per million cycles\n", j,
+                   j < 2 ? "producer" : "consumer", RF_OBJS * 1000000ull / rf_cycles[j]);
+        printk("Usage: %lld\n", alloc_page_cnt.count - r);
+        printk("remote_free_test PASS\n");
+    }
 }
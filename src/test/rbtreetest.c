@@ -61,5 +61,16 @@ void rbtree_test() {
     while (x.count < 8)
         ;
     arch_dsb_sy();
-    if (cid == 0) printk("rbtree_test PASS\n");
+    if (cid == 0) {
+        // Erase everything in key order; the cached leftmost must follow
+        for (int c = 0; c < 4; c++) {
+            for (int i = 0; i < 1000; i++) {
+                if (_rb_first(&rt) != &p[c][i].node)
+                    FAIL("leftmost error! %d\n", p[c][i].key);
+                _rb_erase(&p[c][i].node, &rt);
+            }
+        }
+        if (_rb_first(&rt) != NULL) FAIL("leftmost not NULL\n");
+        printk("rbtree_test PASS\n");
+    }
 }
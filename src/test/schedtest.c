@@ -0,0 +1,416 @@
+#include <aarch64/intrinsic.h>
+#include <common/sem.h>
+#include <driver/clock.h>
+#include <kernel/container.h>
+#include <kernel/cpu.h>
+#include <kernel/mem.h>
+#include <kernel/printk.h>
+#include <kernel/proc.h>
+#include <kernel/sched.h>
+#include <test/test.h>
+
+#define YIELD_ROUNDS 10000
+#define IDLE_CONTAINERS 300
+
+static Semaphore idle_started;
+
+static void idle_container_root(u64 arg)
+{
+    (void) arg;
+    post_sem(&idle_started);
+    // Root procs never exit: sleep for good, leaving the container empty
+    setup_checker(0);
+    lock_for_sched(0);
+    sched(0, DEEPSLEEPING);
+}
+
+// Average cycles of a yield() that has to go through the scheduler's pick.
+static u64 yield_cycles()
+{
+    u64 t = get_timestamp();
+    for (int i = 0; i < YIELD_ROUNDS; i++)
+        yield();
+    return (get_timestamp() - t) / YIELD_ROUNDS;
+}
+
+static volatile int switch_started;
+static u64 switch_elapsed;
+
+static void switcher(u64 user)
+{
+    // A user mapping of its own, so that every switch loads a new TTBR0
+    void* page = NULL;
+    if (user) {
+        page = kalloc_page();
+        *get_pte(&thisproc()->pgdir, 0x400000, true) = K2P(page) | PTE_USER_DATA;
+    }
+    __atomic_fetch_add(&switch_started, 1, __ATOMIC_RELAXED);
+    while (switch_started < 2)
+        yield();
+    u64 t = get_timestamp();
+    for (int i = 0; i < YIELD_ROUNDS; i++)
+        yield();
+    switch_elapsed = get_timestamp() - t;
+    // Unmap the page, here and in every TLB, before freeing it
+    free_pgdir(&thisproc()->pgdir);
+    if (page)
+        kfree_page(page);
+    exit(0);
+}
+
+// Average cycles of a switch between two procs yielding to each other on
+// another cpu, with or without page tables of their own.
+static u64 switch_cycles(bool user)
+{
+    u64 mask = 1ull << ((cpuid() + 1) % NCPU);
+    switch_started = 0;
+    for (int i = 0; i < 2; i++) {
+        auto p = create_proc();
+        set_parent_to_this(p);
+        ASSERT(set_affinity(p, mask) == 0);
+        start_proc(p, switcher, user);
+    }
+    int code, pid;
+    for (int i = 0; i < 2; i++)
+        ASSERT(wait(&code, &pid) != -1);
+    // The last one to finish saw both procs' yields
+    return switch_elapsed / (2 * YIELD_ROUNDS);
+}
+
+void sched_test()
+{
+    printk("sched_test\n");
+    u64 kernel_switch = switch_cycles(false), user_switch = switch_cycles(true);
+    printk("switch: %llu cycles between procs without page tables, %llu with\n",
+           kernel_switch, user_switch);
+    u64 before = yield_cycles();
+    init_sem(&idle_started, 0);
+    for (int i = 0; i < IDLE_CONTAINERS; i++)
+        create_container(idle_container_root, i);
+    for (int i = 0; i < IDLE_CONTAINERS; i++)
+        unalertable_wait_sem(&idle_started);
+    u64 after = yield_cycles();
+    printk("yield: %llu cycles, %llu with %d idle containers\n", before, after,
+           IDLE_CONTAINERS);
+    printk("sched_test PASS\n");
+}
+
+#define SHARE_WORKERS 8
+#define SHARE_TEST_MS 2000
+
+static volatile bool share_stop;
+static u64 share_turns[2];
+static Semaphore share_done;
+
+// Burn about 2 ms per turn, then give the cpu back.
+static void share_worker(u64 id)
+{
+    while (!share_stop) {
+        u64 t = get_timestamp_ms();
+        while (get_timestamp_ms() < t + 2)
+            ;
+        __atomic_fetch_add(&share_turns[id], 1, __ATOMIC_RELAXED);
+        yield();
+    }
+    exit(0);
+}
+
+static void share_root(u64 id)
+{
+    set_container_shares(thisproc()->container, id == 0 ? 2 * NICE_0_WEIGHT : NICE_0_WEIGHT);
+    for (int i = 0; i < SHARE_WORKERS; i++) {
+        auto p = create_proc();
+        set_parent_to_this(p);
+        set_container_to_this(p);
+        start_proc(p, share_worker, id);
+    }
+    int code, pid;
+    for (int i = 0; i < SHARE_WORKERS; i++)
+        ASSERT(wait(&code, &pid) != -1);
+    post_sem(&share_done);
+    setup_checker(0);
+    lock_for_sched(0);
+    sched(0, DEEPSLEEPING);
+}
+
+// Two containers with equal work and shares 2048:1024 should split the
+// cpus 2:1.
+void share_test()
+{
+    printk("share_test\n");
+    share_stop = false;
+    share_turns[0] = share_turns[1] = 0;
+    init_sem(&share_done, 0);
+    create_container(share_root, 0);
+    create_container(share_root, 1);
+    u64 t = get_timestamp_ms();
+    while (get_timestamp_ms() < t + SHARE_TEST_MS)
+        yield();
+    share_stop = true;
+    for (int i = 0; i < 2; i++)
+        ASSERT(wait_sem(&share_done));
+    u64 ratio = share_turns[0] * 100 / MAX(share_turns[1], 1ull);
+    printk("turns: %llu (shares 2048) vs %llu (shares 1024), ratio %llu%%\n",
+           share_turns[0], share_turns[1], ratio);
+    ASSERT(ratio >= 150 && ratio <= 250);
+    printk("share_test PASS\n");
+}
+
+#define IDLE_MEASURE_MS 2000
+
+// Interrupts taken by each cpu while this one spins for `ms`. The
+// spinning cpu keeps interrupts off, so the other three stay idle.
+static void idle_irqs(u64 irqs[NCPU], u64 ms)
+{
+    for (int i = 0; i < NCPU; i++)
+        irqs[i] = cpus[i].nr_irqs;
+    u64 t = get_timestamp_ms();
+    while (get_timestamp_ms() < t + ms)
+        ;
+    for (int i = 0; i < NCPU; i++)
+        irqs[i] = cpus[i].nr_irqs - irqs[i];
+}
+
+void tickless_test()
+{
+    printk("tickless_test\n");
+    u64 ticking[NCPU], tickless[NCPU];
+    bool old = sched_tickless;
+    // Let every cpu go through the scheduler once in each mode first
+    sched_tickless = false;
+    idle_irqs(ticking, 500);
+    idle_irqs(ticking, IDLE_MEASURE_MS);
+    sched_tickless = true;
+    idle_irqs(tickless, 500);
+    idle_irqs(tickless, IDLE_MEASURE_MS);
+    sched_tickless = old;
+    for (int i = 0; i < NCPU; i++)
+        printk("CPU %d: %llu interrupts in %d ms idle with the tick, %llu tickless\n", i,
+               ticking[i], IDLE_MEASURE_MS, tickless[i]);
+    // The spinning cpu takes no interrupts either way
+    for (int i = 0; i < NCPU; i++)
+        if (i != cpuid())
+            ASSERT(tickless[i] < ticking[i]);
+    printk("tickless_test PASS\n");
+}
+
+#define RT_HOGS NCPU
+#define CFS_HOGS (2 * NCPU)
+#define RT_TEST_MS 2000
+
+static volatile bool rt_stop;
+static u64 rt_turns[2];
+
+// Burn about 2 ms per turn, then give the cpu back. RT hogs only ever
+// yield to each other, so CFS hogs run on their cpus only once the RT
+// budget is used up.
+static void rt_hog(u64 rt)
+{
+    while (!rt_stop) {
+        u64 t = get_timestamp_ms();
+        while (get_timestamp_ms() < t + 2)
+            ;
+        __atomic_fetch_add(&rt_turns[rt], 1, __ATOMIC_RELAXED);
+        yield();
+    }
+    exit(0);
+}
+
+void rt_test()
+{
+    printk("rt_test\n");
+    rt_stop = false;
+    rt_turns[0] = rt_turns[1] = 0;
+    for (int i = 0; i < RT_HOGS + CFS_HOGS; i++) {
+        bool rt = i < RT_HOGS;
+        auto p = create_proc();
+        set_parent_to_this(p);
+        if (rt)
+            ASSERT(set_sched_policy(p, SCHED_FIFO, 10) == 0);
+        start_proc(p, rt_hog, rt);
+    }
+    u64 t = get_timestamp_ms();
+    while (get_timestamp_ms() < t + RT_TEST_MS)
+        yield();
+    rt_stop = true;
+    int code, pid;
+    for (int i = 0; i < RT_HOGS + CFS_HOGS; i++)
+        ASSERT(wait(&code, &pid) != -1);
+    printk("turns: %llu RT, %llu CFS, RT budget %llu/%llu ms\n", rt_turns[1],
+           rt_turns[0], sched_rt_runtime_ms, sched_rt_period_ms);
+    // This proc is CFS too: getting here at all means RT did not starve it
+    ASSERT(rt_turns[1] > 0 && rt_turns[0] > 0);
+    printk("rt_test PASS\n");
+}
+
+#define PIN_WORKERS 8
+#define PIN_HOGS (2 * NCPU)
+#define PIN_TEST_MS 2000
+
+static volatile bool pin_stop, pin_move;
+static u64 pin_turns, pin_strays;
+static u64 pin_mask[PIN_WORKERS], pin_moved_turns[PIN_WORKERS];
+
+// Pinned to one cpu, and halfway through the test to the next one.
+// Counts every turn it gets on a cpu outside its mask, and the turns it
+// gets once moved.
+static void pin_worker(u64 id)
+{
+    bool moved = false;
+    while (!pin_stop) {
+        if (pin_move && !moved) {
+            pin_mask[id] = 1ull << ((id + 1) % NCPU);
+            ASSERT(set_affinity(thisproc(), pin_mask[id]) == 0);
+            moved = true;
+            yield();
+        }
+        if (!((pin_mask[id] >> cpuid()) & 1))
+            __atomic_fetch_add(&pin_strays, 1, __ATOMIC_RELAXED);
+        u64 t = get_timestamp_ms();
+        while (get_timestamp_ms() < t + 1)
+            ;
+        __atomic_fetch_add(&pin_turns, 1, __ATOMIC_RELAXED);
+        if (moved)
+            pin_moved_turns[id]++;
+        yield();
+    }
+    exit(0);
+}
+
+// Pinned procs must never run on other cpus, while unpinned hogs keep
+// every cpu busy and stealing from each other. Half of them are RR. Once
+// re-pinned, each must still get to run on its new cpu.
+void affinity_test()
+{
+    printk("affinity_test\n");
+    pin_stop = pin_move = share_stop = false;
+    pin_turns = pin_strays = 0;
+    for (int i = 0; i < PIN_WORKERS + PIN_HOGS; i++) {
+        auto p = create_proc();
+        set_parent_to_this(p);
+        if (i < PIN_WORKERS) {
+            pin_mask[i] = 1ull << (i % NCPU);
+            pin_moved_turns[i] = 0;
+            ASSERT(set_affinity(p, pin_mask[i]) == 0);
+            if (i >= NCPU)
+                ASSERT(set_sched_policy(p, SCHED_RR, 1) == 0);
+            start_proc(p, pin_worker, i);
+        } else {
+            start_proc(p, share_worker, 0);
+        }
+    }
+    u64 t = get_timestamp_ms();
+    while (get_timestamp_ms() < t + PIN_TEST_MS) {
+        if (get_timestamp_ms() >= t + PIN_TEST_MS / 2)
+            pin_move = true;
+        yield();
+    }
+    pin_stop = share_stop = true;
+    int code, pid;
+    for (int i = 0; i < PIN_WORKERS + PIN_HOGS; i++)
+        ASSERT(wait(&code, &pid) != -1);
+    printk("pinned procs: %llu turns, %llu on a disallowed cpu\n", pin_turns, pin_strays);
+    ASSERT(pin_turns > 0 && pin_strays == 0);
+    for (int i = 0; i < PIN_WORKERS; i++)
+        ASSERT(pin_moved_turns[i] > 0);
+    printk("affinity_test PASS\n");
+}
+
+#define QUOTA_WORKERS NCPU
+#define QUOTA_MS 25
+#define QUOTA_PERIOD_MS 100
+#define QUOTA_TEST_MS 2000
+
+static Semaphore quota_done;
+
+static void quota_root(u64 arg)
+{
+    (void) arg;
+    set_container_quota(thisproc()->container, QUOTA_MS, QUOTA_PERIOD_MS);
+    for (int i = 0; i < QUOTA_WORKERS; i++) {
+        auto p = create_proc();
+        set_parent_to_this(p);
+        set_container_to_this(p);
+        start_proc(p, share_worker, 0);
+    }
+    int code, pid;
+    for (int i = 0; i < QUOTA_WORKERS; i++)
+        ASSERT(wait(&code, &pid) != -1);
+    post_sem(&quota_done);
+    setup_checker(0);
+    lock_for_sched(0);
+    sched(0, DEEPSLEEPING);
+}
+
+// A container capped at 25% of a cpu, with a worker for every cpu, should
+// get about 25% of one cpu, even with the other cpus idle.
+void quota_test()
+{
+    printk("quota_test\n");
+    share_stop = false;
+    init_sem(&quota_done, 0);
+    auto c = create_container(quota_root, 0);
+    // Let the workers start and go through a few periods first
+    u64 t = get_timestamp_ms();
+    while (get_timestamp_ms() < t + 3 * QUOTA_PERIOD_MS)
+        yield();
+    u64 used = c->cpu_time;
+    t = get_timestamp_ms();
+    while (get_timestamp_ms() < t + QUOTA_TEST_MS)
+        yield();
+    used = c->cpu_time - used;
+    share_stop = true;
+    ASSERT(wait_sem(&quota_done));
+    u64 pct = used * 100 / (QUOTA_TEST_MS * (get_clock_frequency() / 1000));
+    printk("capped container: %llu%% of a cpu, quota %d%%\n", pct,
+           QUOTA_MS * 100 / QUOTA_PERIOD_MS);
+    ASSERT(pct >= 20 && pct <= 30);
+    printk("quota_test PASS\n");
+}
+
+#define PELT_TEST_MS 1000
+
+static Semaphore pelt_done;
+
+// Run `n` workers in this container until share_stop.
+static void pelt_root(u64 n)
+{
+    for (u64 i = 0; i < n; i++) {
+        auto p = create_proc();
+        set_parent_to_this(p);
+        set_container_to_this(p);
+        start_proc(p, share_worker, 0);
+    }
+    int code, pid;
+    for (u64 i = 0; i < n; i++)
+        ASSERT(wait(&code, &pid) != -1);
+    post_sem(&pelt_done);
+    setup_checker(0);
+    lock_for_sched(0);
+    sched(0, DEEPSLEEPING);
+}
+
+// A container with a busy worker should build up most of a cpu's worth of
+// utilization, while an empty one decays to about nothing.
+void pelt_test()
+{
+    printk("pelt_test\n");
+    share_stop = false;
+    init_sem(&pelt_done, 0);
+    auto busy = create_container(pelt_root, 1);
+    auto idle = create_container(pelt_root, 0);
+    u64 t = get_timestamp_ms();
+    while (get_timestamp_ms() < t + PELT_TEST_MS)
+        yield();
+    u64 busy_util = container_util_avg(busy), idle_util = container_util_avg(idle);
+    u64 busy_load = container_load_avg(busy), idle_load = container_load_avg(idle);
+    share_stop = true;
+    for (int i = 0; i < 2; i++)
+        ASSERT(wait_sem(&pelt_done));
+    printk("util avg: %llu busy vs %llu idle, load avg: %llu vs %llu\n", busy_util,
+           idle_util, busy_load, idle_load);
+    ASSERT(busy_util > PELT_SCALE / 2 && busy_util > idle_util);
+    ASSERT(busy_load > idle_load);
+    ASSERT(idle_util < PELT_SCALE / 16);
+    printk("pelt_test PASS\n");
+}
@@ -0,0 +1,158 @@
+#include <aarch64/intrinsic.h>
+#include <common/sem.h>
+#include <kernel/mem.h>
+#include <kernel/printk.h>
+#include <kernel/proc.h>
+#include <kernel/sched.h>
+#include <test/test.h>
+
+#define ROUNDS 10000
+
+static Semaphore ping, pong;
+
+static void ponger(u64 n)
+{
+    for (u64 i = 0; i < n; i++)
+    {
+        unalertable_wait_sem(&ping);
+        post_sem(&pong);
+    }
+    exit(0);
+}
+
+// Average cycles for one post(ping) -> wait(pong) round trip with a second
+// process on the other end. Every blocking wait allocates a WaitData.
+static u64 sem_round_trip(u64 n)
+{
+    init_sem(&ping, 0);
+    init_sem(&pong, 0);
+    auto p = create_proc();
+    set_parent_to_this(p);
+    start_proc(p, ponger, n);
+    u64 t = get_timestamp();
+    for (u64 i = 0; i < n; i++)
+    {
+        post_sem(&ping);
+        unalertable_wait_sem(&pong);
+    }
+    t = get_timestamp() - t;
+    int code, pid;
+    ASSERT(wait(&code, &pid) != -1);
+    return t / n;
+}
+
+static Semaphore wake, ack;
+static volatile u64 wake_posted;
+static u64 wake_total;
+
+static void wakee(u64 n)
+{
+    for (u64 i = 0; i < n; i++)
+    {
+        unalertable_wait_sem(&wake);
+        wake_total += get_timestamp() - wake_posted;
+        post_sem(&ack);
+    }
+    exit(0);
+}
+
+// Average cycles from post_sem() until a waiter sleeping on another cpu
+// returns from wait_sem().
+static u64 wakeup_latency(u64 n)
+{
+    init_sem(&wake, 0);
+    init_sem(&ack, 0);
+    wake_total = 0;
+    auto p = create_proc();
+    set_parent_to_this(p);
+    start_proc(p, wakee, n);
+    for (u64 i = 0; i < n; i++)
+    {
+        // Give the wakee time to go back to sleep, and its cpu to idle
+        u64 t = get_timestamp();
+        while (get_timestamp() < t + 100000)
+            ;
+        wake_posted = get_timestamp();
+        post_sem(&wake);
+        unalertable_wait_sem(&ack);
+    }
+    int code, pid;
+    ASSERT(wait(&code, &pid) != -1);
+    return wake_total / n;
+}
+
+#define PINGPONG_WS (16 * 1024)
+
+static Semaphore hit, ret;
+
+// Write every cache line of `buf`
+static void touch(volatile u64* buf)
+{
+    for (usize i = 0; i < PINGPONG_WS / sizeof(u64); i += 8)
+        buf[i]++;
+}
+
+static void pinger(u64 n)
+{
+    u64* buf = kalloc(PINGPONG_WS);
+    ASSERT(buf);
+    for (u64 i = 0; i < n; i++)
+    {
+        unalertable_wait_sem(&hit);
+        touch(buf);
+        post_sem(&ret);
+    }
+    kfree(buf);
+    exit(0);
+}
+
+// Round trips per second between two procs that each write their own
+// PINGPONG_WS bytes every turn, so that a turn on a cold cpu takes misses.
+static u64 pingpong_rate(u64 n)
+{
+    init_sem(&hit, 0);
+    init_sem(&ret, 0);
+    u64* buf = kalloc(PINGPONG_WS);
+    ASSERT(buf);
+    auto p = create_proc();
+    set_parent_to_this(p);
+    start_proc(p, pinger, n);
+    u64 t = get_timestamp();
+    for (u64 i = 0; i < n; i++)
+    {
+        touch(buf);
+        post_sem(&hit);
+        unalertable_wait_sem(&ret);
+    }
+    t = get_timestamp() - t;
+    int code, pid;
+    ASSERT(wait(&code, &pid) != -1);
+    kfree(buf);
+    return n * get_clock_frequency() / t;
+}
+
+void sem_test()
+{
+    printk("sem_test\n");
+    kmem_cpu_cache_enabled = false;
+    u64 off = sem_round_trip(ROUNDS);
+    kmem_cpu_cache_enabled = true;
+    u64 on = sem_round_trip(ROUNDS);
+    printk("wait/post round trip: %llu cycles (per-cpu object cache off), %llu (on)\n", off, on);
+    bool ipi = sched_wakeup_ipi;
+    sched_wakeup_ipi = false;
+    off = wakeup_latency(ROUNDS / 100);
+    sched_wakeup_ipi = true;
+    on = wakeup_latency(ROUNDS / 100);
+    sched_wakeup_ipi = ipi;
+    printk("cross-cpu wakeup latency: %llu cycles without IPIs, %llu with\n", off, on);
+    bool prev = sched_wake_prev_cpu;
+    sched_wake_prev_cpu = false;
+    off = pingpong_rate(ROUNDS);
+    sched_wake_prev_cpu = true;
+    on = pingpong_rate(ROUNDS);
+    sched_wake_prev_cpu = prev;
+    printk("ping-pong, %d KB each: %llu round trips/s waking on any cpu, %llu on the last one\n",
+           PINGPONG_WS / 1024, off, on);
+    printk("sem_test PASS\n");
+}
@@ -3,11 +3,21 @@
 #define RAND_MAX 32768
 
 void alloc_test();
+void buddy_test();
+void remote_free_test();
 void rbtree_test();
 void proc_test();
 void ipc_test();
 void vm_test();
 void container_test();
+void sem_test();
+void sched_test();
+void share_test();
+void tickless_test();
+void rt_test();
+void affinity_test();
+void quota_test();
+void pelt_test();
 void user_proc_test();
 unsigned rand();
 void srand(unsigned seed);
\ No newline at end of file
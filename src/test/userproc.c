@@ -8,6 +8,7 @@
 #include <kernel/sched.h>
 #include <kernel/proc.h>
 #include <kernel/syscall.h>
+#include <kernel/cpu.h>
 
 PTEntriesPtr get_pte(struct pgdir* pgdir, u64 va, bool alloc);
 
@@ -109,6 +110,9 @@ void user_proc_test()
     memset(proc_cnt, 0, sizeof(proc_cnt));
     memset(cpu_cnt, 0, sizeof(cpu_cnt));
     stop = false;
+    u64 lock_cycles[4];
+    for (int i = 0; i < 4; i++)
+        lock_cycles[i] = cpus[i].sched.lock_cycles;
     for (int i = 0; i < 22; i++)
         _create_user_proc(i);
     ASSERT(wait_sem(&myrepot_done));
@@ -119,7 +123,8 @@ void user_proc_test()
         _wait_user_proc();
     printk("user_proc_test PASS\nRuntime:\n");
     for (int i = 0; i < 4; i++)
-        printk("CPU %d: %llu\n", i, cpu_cnt[i]);
+        printk("CPU %d: %llu, run queue lock held %llu cycles\n", i, cpu_cnt[i],
+               cpus[i].sched.lock_cycles - lock_cycles[i]);
     for (int i = 0; i < 22; i++)
         printk("Proc %d: %llu\n", i, proc_cnt[i]);
 }